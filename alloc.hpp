@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+
+// Small per-thread number, handed out in the order threads first ask. Spreads threads over stripes
+// of locks or counters.
+inline size_t thread_index() {
+    static std::atomic<size_t> threads(0);
+    thread_local const size_t index = threads.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+
+// Node allocation policies of the trees, every tree owns one instance.
+// create and destroy construct and free a single node. An allocator that releases_in_bulk frees all
+// of its memory at once when it is released or destroyed, so tearing down a tree does not have to
+// free it node by node, only nodes owning memory themselves still need their destructor.
+
+// Every node from the global new and delete.
+class HeapAllocator {
+public:
+    static constexpr bool releases_in_bulk = false;
+
+    template <class Node, class... Args>
+    Node *create(Args&&... args) { return new Node(std::forward<Args>(args)...); }
+
+    template <class Node>
+    void destroy(Node *node) { delete node; }
+};
+
+
+// Nodes are carved from 64 KiB slabs, in size classes of 16 bytes, each class with its own free list.
+// Threads are spread over shards with their own slabs and free lists, so concurrent writers rarely
+// meet on a shard lock. A freed slot goes to the free list of the freeing thread's shard.
+class SlabAllocator {
+public:
+    static constexpr bool releases_in_bulk = true;
+
+    SlabAllocator() = default;
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+    ~SlabAllocator() { release(); }
+
+    template <class Node, class... Args>
+    Node *create(Args&&... args) {
+        static_assert(sizeof(Node) <= GRANULE * CLASSES, "node does not fit the slab size classes");
+        static_assert(alignof(Node) <= GRANULE, "node alignment exceeds the slot alignment");
+        return new (allocate(size_class(sizeof(Node)))) Node(std::forward<Args>(args)...);
+    }
+
+    template <class Node>
+    void destroy(Node *node) {
+        node->~Node();
+        deallocate(node, size_class(sizeof(Node)));
+    }
+
+    // Frees every slab at once. No node may be used anymore, their destructors are not run.
+    void release() {
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            for (char *slab : shard.slabs) ::operator delete(slab);
+            shard.slabs.clear();
+            for (size_t c = 0; c < CLASSES; ++c) {
+                shard.free[c] = nullptr;
+                shard.bump[c] = shard.bump_end[c] = nullptr;
+            }
+        }
+    }
+
+    // Number of slabs allocated so far
+    size_t slabs() const {
+        size_t count = 0;
+        for (const Shard &shard : shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            count += shard.slabs.size();
+        }
+        return count;
+    }
+
+private:
+    static constexpr size_t GRANULE = 16;
+    static constexpr size_t CLASSES = 32;
+    static constexpr size_t SLAB_BYTES = 64 * 1024;
+    static constexpr size_t SHARDS = 16;
+
+    struct FreeSlot {
+        FreeSlot *next;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex lock;
+        FreeSlot *free[CLASSES] = {};
+        char *bump[CLASSES] = {};
+        char *bump_end[CLASSES] = {};
+        std::vector<char*> slabs;
+    };
+
+    static size_t size_class(const size_t size) { return (size + GRANULE - 1) / GRANULE - 1; }
+
+    Shard &local_shard() { return shards[thread_index() % SHARDS]; }
+
+    void *allocate(const size_t c) {
+        Shard &shard = local_shard();
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if (FreeSlot *slot = shard.free[c]) {
+            shard.free[c] = slot->next;
+            return slot;
+        }
+        const size_t size = (c + 1) * GRANULE;
+        if (shard.bump[c] == nullptr || static_cast<size_t>(shard.bump_end[c] - shard.bump[c]) < size) {
+            char *slab = static_cast<char*>(::operator new(SLAB_BYTES));
+            shard.slabs.push_back(slab);
+            shard.bump[c] = slab;
+            shard.bump_end[c] = slab + SLAB_BYTES;
+        }
+        void *ptr = shard.bump[c];
+        shard.bump[c] += size;
+        return ptr;
+    }
+
+    void deallocate(void *ptr, const size_t c) {
+        Shard &shard = local_shard();
+        std::lock_guard<std::mutex> guard(shard.lock);
+        FreeSlot *slot = static_cast<FreeSlot*>(ptr);
+        slot->next = shard.free[c];
+        shard.free[c] = slot;
+    }
+
+private:
+    Shard shards[SHARDS];
+};
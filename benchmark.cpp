@@ -1,5 +1,12 @@
 #include <benchmark/benchmark.h>
 #include <cstddef>
+#include <cstdlib>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <new>
+#include <malloc.h>
 #include <random>
 #include <thread>
 #include <vector>
@@ -8,10 +15,40 @@
 
 #include "it.hpp"
 #include "pit.hpp"
+#include "sit.hpp"
+#include "sht.hpp"
+#include "persistent.hpp"
+#include "cit.hpp"
 #include "datagen.hpp"
+#include "harness.hpp"
+#include "snapshot.hpp"
 
 
 
+// Every heap allocation is counted, so the layout benchmarks can report allocations per insert,
+// and live heap bytes are tracked for the memory footprint benchmarks.
+static std::atomic<size_t> allocation_count(0);
+static std::atomic<size_t> live_bytes(0);
+
+// Inlined, the free below looks to GCC like freeing memory from operator new, but this pair is the allocator.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size)) {
+        live_bytes.fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed);
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept {
+    if (ptr) live_bytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+    std::free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept { operator delete(ptr); }
+#pragma GCC diagnostic pop
+
+
 
 static void BM_FixedInsert_SingleThread(benchmark::State& state) {
     for (auto _ : state) {
@@ -118,53 +155,783 @@ void threadFunc(ParallelIntervalTree<TYP> &pt, const Data<TYP>& DAT, const size_
     }
 }
 
+// The workers are created once per benchmark and released together (see WorkerPool), only the
+// operations themselves are timed.
 template <class THnum>
 static void BM_Parallel(benchmark::State& state, const bool prepare, const Data<TYP>& PRE, const Data<TYP>& DAT, const THnum threads) {
+    WorkerPool pool(threads);
     if (prepare) {
         ParallelIntervalTree<int> pt;
         threadFunc(pt, PRE, 0, 1);
         for (auto _ : state) {
-            std::vector<std::thread> ths;
-            for (size_t i = 0; i < threads; ++i)
-                ths.emplace_back(threadFunc, std::ref(pt), std::ref(DAT), i, threads);
-            for (size_t i = threads; i < 4; ++i)
-                ths.emplace_back(dummyThread);
-            for (size_t i = 0; i < ths.size(); ++i)
-                ths[i].join();
+            state.SetIterationTime(pool.run([&](const size_t i) { threadFunc(pt, DAT, i, threads); }));
         }
     } else {
         for (auto _ : state) {
             ParallelIntervalTree<int> pt;
-            std::vector<std::thread> ths;
-            for (size_t i = 0; i < threads; ++i)
-                ths.emplace_back(threadFunc, std::ref(pt), std::ref(DAT), i, threads);
-            for (size_t i = 0; i < threads; ++i)
-                ths[i].join();
+            state.SetIterationTime(pool.run([&](const size_t i) { threadFunc(pt, DAT, i, threads); }));
+        }
+    }
+}
+
+
+BENCHMARK_CAPTURE(BM_Parallel, Insert/TH1, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT), 1)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, Insert/TH2, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT), 2)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, Insert/TH3, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT), 3)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, Insert/TH4, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT), 4)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_Parallel, InsertRemove/TH1, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_REMOVE), 1)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, InsertRemove/TH2, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_REMOVE), 2)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, InsertRemove/TH3, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_REMOVE), 3)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, InsertRemove/TH4, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_REMOVE), 4)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_Parallel, Query/TH1, true, std::ref(DAT_INSERT), std::ref(DAT_QUERY), 1)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, Query/TH2, true, std::ref(DAT_INSERT), std::ref(DAT_QUERY), 2)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, Query/TH3, true, std::ref(DAT_INSERT), std::ref(DAT_QUERY), 3)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, Query/TH4, true, std::ref(DAT_INSERT), std::ref(DAT_QUERY), 4)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_Parallel, InsertQueryRemove/TH1, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_QUERY_REMOVE), 1)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, InsertQueryRemove/TH2, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_QUERY_REMOVE), 2)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, InsertQueryRemove/TH3, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_QUERY_REMOVE), 3)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parallel, InsertQueryRemove/TH4, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_QUERY_REMOVE), 4)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+
+
+
+// TAIL LATENCY: every operation is timed, the p50/p99/p999 latencies per method are reported in microseconds.
+
+Data<TYP>             DAT_LATENCY(2E4, 0, 1E5, dim, 0.2,  0.7, 0.08, 0.02);
+
+typedef std::array<LatencyHistogram, 3> Latencies;
+
+void timedThreadFunc(ParallelIntervalTree<TYP> &pt, const Data<TYP>& DAT, const size_t offset, const size_t step, Latencies &latencies) {
+    for (size_t i = offset; i < DAT.tsks.size(); i += step) {
+        auto& tsk = DAT.tsks[i];
+        if (tsk.method == DAT.NOOP) continue;
+        auto start = std::chrono::steady_clock::now();
+        switch (tsk.method) {
+        case DAT.QUERY:
+            benchmark::DoNotOptimize(pt.query(tsk.a));
+            break;
+        case DAT.INSERT:
+            pt.insert(tsk.a, tsk.b);
+            break;
+        case DAT.REMOVE:
+            pt.remove(tsk.a, tsk.b);
+            break;
+        default:
+            break;
+        }
+        auto stop = std::chrono::steady_clock::now();
+        latencies[tsk.method].record(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+    }
+}
+
+template <class THnum>
+static void BM_Latency(benchmark::State& state, const Data<TYP>& DAT, const THnum threads) {
+    WorkerPool pool(threads);
+    Latencies latencies;
+    for (auto _ : state) {
+        ParallelIntervalTree<TYP> pt;
+        std::vector<Latencies> per_thread(threads);
+        state.SetIterationTime(pool.run([&](const size_t i) { timedThreadFunc(pt, DAT, i, threads, per_thread[i]); }));
+        for (auto& thread_latencies : per_thread)
+            for (size_t m = 0; m < latencies.size(); ++m)
+                latencies[m].merge(thread_latencies[m]);
+    }
+    const char* names[] = {"query", "insert", "remove"};
+    for (size_t m = 0; m < latencies.size(); ++m) {
+        state.counters[std::string(names[m]) + "_p50"] = latencies[m].percentile(0.5) / 1E3;
+        state.counters[std::string(names[m]) + "_p99"] = latencies[m].percentile(0.99) / 1E3;
+        state.counters[std::string(names[m]) + "_p999"] = latencies[m].percentile(0.999) / 1E3;
+    }
+}
+
+BENCHMARK_CAPTURE(BM_Latency, InsertQueryRemove/TH1, std::ref(DAT_LATENCY), 1)->Iterations(3)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Latency, InsertQueryRemove/TH4, std::ref(DAT_LATENCY), 4)->Iterations(3)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+
+
+
+// POINT LAYOUT: std::vector backed Point<T> vs inline Point<T, 1>
+
+Data<TYP, 1>           DAT1_INSERT(1E4, 0, 100, 1, 0,   1,    0,    0);
+Data<TYP, 1>            DAT1_QUERY(1E4, 0, 100, 1, 1,   0,    0,    0);
+
+typedef IntervalTree<TYP>                 IT_Dynamic;
+typedef IntervalTree<TYP, 1>              IT_Fixed;
+typedef ParallelIntervalTree<TYP>         PIT_Dynamic;
+typedef ParallelIntervalTree<TYP, 1>      PIT_Fixed;
+
+// Insert and query datasets matching the Point layout of a tree.
+template <class P> struct LayoutData;
+template <> struct LayoutData<Point<TYP>> {
+    static const Data<TYP>& insert() { return DAT_INSERT; }
+    static const Data<TYP>& query() { return DAT_QUERY; }
+};
+template <> struct LayoutData<Point<TYP, 1>> {
+    static const Data<TYP, 1>& insert() { return DAT1_INSERT; }
+    static const Data<TYP, 1>& query() { return DAT1_QUERY; }
+};
+
+template <class Tree>
+static void BM_Layout_Insert(benchmark::State& state) {
+    auto& INS = LayoutData<typename Tree::P>::insert();
+    size_t allocations = 0, inserts = 0;
+    for (auto _ : state) {
+        Tree t;
+        size_t before = allocation_count.load(std::memory_order_relaxed);
+        for (auto& tsk : INS.tsks)
+            t.insert(tsk.a, tsk.b);
+        allocations += allocation_count.load(std::memory_order_relaxed) - before;
+        inserts += INS.tsks.size();
+    }
+    state.counters["allocs/insert"] = static_cast<double>(allocations) / inserts;
+    state.SetItemsProcessed(inserts);
+}
+
+// Endpoints handed over with insert(P&&, P&&): copied outside the counted loop, moved into the nodes.
+template <class Tree>
+static void BM_Layout_InsertMove(benchmark::State& state) {
+    auto& INS = LayoutData<typename Tree::P>::insert();
+    size_t allocations = 0, inserts = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::vector<typename Tree::I> intervals;
+        intervals.reserve(INS.tsks.size());
+        for (auto& tsk : INS.tsks)
+            intervals.emplace_back(tsk.a, tsk.b);
+        state.ResumeTiming();
+        Tree t;
+        size_t before = allocation_count.load(std::memory_order_relaxed);
+        for (auto& interval : intervals)
+            t.insert(std::move(interval));
+        allocations += allocation_count.load(std::memory_order_relaxed) - before;
+        inserts += intervals.size();
+    }
+    state.counters["allocs/insert"] = static_cast<double>(allocations) / inserts;
+    state.SetItemsProcessed(inserts);
+}
+
+template <class Tree>
+static void BM_Layout_Query(benchmark::State& state) {
+    auto& INS = LayoutData<typename Tree::P>::insert();
+    auto& QRY = LayoutData<typename Tree::P>::query();
+    Tree t;
+    for (auto& tsk : INS.tsks)
+        t.insert(tsk.a, tsk.b);
+    size_t queries = 0;
+    for (auto _ : state) {
+        for (auto& tsk : QRY.tsks)
+            benchmark::DoNotOptimize(t.query(tsk.a));
+        queries += QRY.tsks.size();
+    }
+    state.SetItemsProcessed(queries);
+}
+
+BENCHMARK_TEMPLATE(BM_Layout_Insert, IT_Dynamic)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Layout_Insert, IT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Layout_Insert, PIT_Dynamic)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Layout_Insert, PIT_Fixed)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_TEMPLATE(BM_Layout_InsertMove, IT_Dynamic)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Layout_InsertMove, PIT_Dynamic)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_TEMPLATE(BM_Layout_Query, IT_Dynamic)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Layout_Query, IT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Layout_Query, PIT_Dynamic)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Layout_Query, PIT_Fixed)->Unit(benchmark::kMillisecond);
+
+
+
+
+// MEMORY FOOTPRINT: live heap bytes of a tree per stored interval, the intervals themselves included.
+
+template <class Tree>
+static void BM_Memory(benchmark::State& state) {
+    auto& INS = LayoutData<typename Tree::P>::insert();
+    size_t bytes = 0, intervals = 0;
+    for (auto _ : state) {
+        size_t before = live_bytes.load(std::memory_order_relaxed);
+        Tree* t = new Tree();
+        for (auto& tsk : INS.tsks)
+            t->insert(tsk.a, tsk.b);
+        bytes += live_bytes.load(std::memory_order_relaxed) - before;
+        intervals += INS.tsks.size();
+        delete t;
+    }
+    state.counters["bytes/interval"] = static_cast<double>(bytes) / intervals;
+}
+
+BENCHMARK_TEMPLATE(BM_Memory, IT_Dynamic)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Memory, IT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Memory, PIT_Dynamic)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Memory, PIT_Fixed)->Unit(benchmark::kMillisecond);
+
+
+
+
+// BULK LOAD: one insert call per interval vs build from the whole range.
+
+Data<TYP, 1>             DAT1_LOAD(1E5, 0, 1E6, 1, 0,   1,    0,    0);
+
+template <class Tree>
+static void BM_Load_Insert(benchmark::State& state) {
+    for (auto _ : state) {
+        Tree t;
+        for (auto& tsk : DAT1_LOAD.tsks)
+            t.insert(tsk.a, tsk.b);
+    }
+    state.SetItemsProcessed(state.iterations() * DAT1_LOAD.tsks.size());
+}
+
+template <class Tree>
+static void BM_Load_Build(benchmark::State& state) {
+    std::vector<typename Tree::I> intervals;
+    for (auto& tsk : DAT1_LOAD.tsks)
+        intervals.emplace_back(tsk.a, tsk.b);
+    for (auto _ : state) {
+        Tree t;
+        t.build(intervals.begin(), intervals.end());
+    }
+    state.SetItemsProcessed(state.iterations() * intervals.size());
+}
+
+BENCHMARK_TEMPLATE(BM_Load_Insert, IT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Load_Build, IT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Load_Insert, PIT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Load_Build, PIT_Fixed)->Unit(benchmark::kMillisecond);
+
+
+
+
+
+// BATCHES: an insert/remove workload one call per task vs apply_batch over chunks of it.
+
+Data<TYP, 1>            DAT1_BATCH(1E5, 0, 1E5, 1, 0,   0.8,  0.15, 0.05);
+
+static void BM_Batch_PerTask(benchmark::State& state) {
+    for (auto _ : state) {
+        PIT_Fixed pt;
+        for (auto& tsk : DAT1_BATCH.tsks) {
+            switch (tsk.method) {
+            case DAT1_BATCH.QUERY:
+                benchmark::DoNotOptimize(pt.query(tsk.a));
+                break;
+            case DAT1_BATCH.INSERT:
+                pt.insert(tsk.a, tsk.b);
+                break;
+            case DAT1_BATCH.REMOVE:
+                pt.remove(tsk.a, tsk.b);
+                break;
+            default:
+                break;
+            }
         }
     }
+    state.SetItemsProcessed(state.iterations() * DAT1_BATCH.tsks.size());
 }
 
+static void BM_Batch_Apply(benchmark::State& state) {
+    const size_t batch = state.range(0);
+    for (auto _ : state) {
+        PIT_Fixed pt;
+        for (size_t i = 0; i < DAT1_BATCH.tsks.size(); i += batch) {
+            auto first = DAT1_BATCH.tsks.begin() + i;
+            auto last = DAT1_BATCH.tsks.begin() + std::min(i + batch, DAT1_BATCH.tsks.size());
+            benchmark::DoNotOptimize(pt.apply_batch(first, last));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * DAT1_BATCH.tsks.size());
+}
+
+BENCHMARK(BM_Batch_PerTask)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Batch_Apply)->Arg(64)->Arg(1024)->Arg(16384)->Unit(benchmark::kMillisecond);
+
+
+
+// ALLOCATORS: node allocation from the global heap vs per-thread slabs, insert throughput and
+// teardown time of a loaded tree.
+
+typedef IntervalTree<TYP, 1, SlabAllocator>          IT_Slab;
+typedef ParallelIntervalTree<TYP, 1, SlabAllocator>  PIT_Slab;
+
+template <class Tree>
+static void BM_Alloc_Insert(benchmark::State& state) {
+    for (auto _ : state) {
+        Tree t;
+        for (auto& tsk : DAT1_LOAD.tsks)
+            t.insert(tsk.a, tsk.b);
+        state.PauseTiming();
+        t.clear();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * DAT1_LOAD.tsks.size());
+}
+
+template <class Tree>
+static void BM_Alloc_Teardown(benchmark::State& state) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        Tree* t = new Tree();
+        for (auto& tsk : DAT1_LOAD.tsks)
+            t->insert(tsk.a, tsk.b);
+        state.ResumeTiming();
+        delete t;
+    }
+    state.SetItemsProcessed(state.iterations() * DAT1_LOAD.tsks.size());
+}
+
+BENCHMARK_TEMPLATE(BM_Alloc_Insert, IT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Alloc_Insert, IT_Slab)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Alloc_Insert, PIT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Alloc_Insert, PIT_Slab)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_TEMPLATE(BM_Alloc_Teardown, IT_Fixed)->Iterations(10)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Alloc_Teardown, IT_Slab)->Iterations(10)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Alloc_Teardown, PIT_Fixed)->Iterations(10)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Alloc_Teardown, PIT_Slab)->Iterations(10)->Unit(benchmark::kMillisecond);
+
 
-BENCHMARK_CAPTURE(BM_Parallel, Insert/TH1, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT), 1)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, Insert/TH2, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT), 2)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, Insert/TH3, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT), 3)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, Insert/TH4, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT), 4)->Unit(benchmark::kMillisecond);
 
-BENCHMARK_CAPTURE(BM_Parallel, InsertRemove/TH1, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_REMOVE), 1)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, InsertRemove/TH2, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_REMOVE), 2)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, InsertRemove/TH3, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_REMOVE), 3)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, InsertRemove/TH4, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_REMOVE), 4)->Unit(benchmark::kMillisecond);
+// STATIC SNAPSHOT: pointer trees vs the Eytzinger laid out StaticIntervalTree, stabbing and overlap
+// queries on 4M short intervals, so the trees do not fit the cache and a descent dominates each query.
 
-BENCHMARK_CAPTURE(BM_Parallel, Query/TH1, true, std::ref(DAT_INSERT), std::ref(DAT_QUERY), 1)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, Query/TH2, true, std::ref(DAT_INSERT), std::ref(DAT_QUERY), 2)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, Query/TH3, true, std::ref(DAT_INSERT), std::ref(DAT_QUERY), 3)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, Query/TH4, true, std::ref(DAT_INSERT), std::ref(DAT_QUERY), 4)->Unit(benchmark::kMillisecond);
+typedef StaticIntervalTree<TYP, 1>  SIT_Fixed;
 
-BENCHMARK_CAPTURE(BM_Parallel, InsertQueryRemove/TH1, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_QUERY_REMOVE), 1)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, InsertQueryRemove/TH2, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_QUERY_REMOVE), 2)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, InsertQueryRemove/TH3, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_QUERY_REMOVE), 3)->Unit(benchmark::kMillisecond);
-BENCHMARK_CAPTURE(BM_Parallel, InsertQueryRemove/TH4, false, std::ref(DAT_EMPTY), std::ref(DAT_INSERT_QUERY_REMOVE), 4)->Unit(benchmark::kMillisecond);
+const std::vector<Interval<TYP, 1>>& static_intervals() {
+    static std::vector<Interval<TYP, 1>> intervals = [] {
+        std::mt19937 gen(5);
+        std::uniform_int_distribution<TYP> begin(0, 1E9), length(0, 1E4);
+        std::vector<Interval<TYP, 1>> v;
+        for (size_t i = 0; i < 4E6; ++i) {
+            TYP b = begin(gen);
+            v.emplace_back(b, b + length(gen));
+        }
+        return v;
+    }();
+    return intervals;
+}
+
+Data<TYP, 1>            DAT1_STATIC_QUERY(1E5, 0, 1E9, 1, 1, 0, 0, 0);
+
+template <class Tree>
+const Tree& static_tree() {
+    static Tree *tree = [] {
+        Tree *t = new Tree();
+        t->build(static_intervals().begin(), static_intervals().end());
+        return t;
+    }();
+    return *tree;
+}
+template <>
+const SIT_Fixed& static_tree<SIT_Fixed>() {
+    static SIT_Fixed tree(static_intervals().begin(), static_intervals().end());
+    return tree;
+}
+
+template <class Tree>
+static void BM_Static_Query(benchmark::State& state) {
+    const Tree& t = static_tree<Tree>();
+    for (auto _ : state) {
+        for (auto& tsk : DAT1_STATIC_QUERY.tsks)
+            benchmark::DoNotOptimize(t.query(tsk.a));
+    }
+    state.SetItemsProcessed(state.iterations() * DAT1_STATIC_QUERY.tsks.size());
+}
+
+template <class Tree>
+static void BM_Static_Overlap(benchmark::State& state) {
+    const Tree& t = static_tree<Tree>();
+    for (auto _ : state) {
+        for (auto& tsk : DAT1_STATIC_QUERY.tsks)
+            benchmark::DoNotOptimize(t.count_overlap(tsk.a, tsk.a[0] + 100000));
+    }
+    state.SetItemsProcessed(state.iterations() * DAT1_STATIC_QUERY.tsks.size());
+}
+
+BENCHMARK_TEMPLATE(BM_Static_Query, IT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Static_Query, PIT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Static_Query, SIT_Fixed)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_TEMPLATE(BM_Static_Overlap, IT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Static_Overlap, PIT_Fixed)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Static_Overlap, SIT_Fixed)->Unit(benchmark::kMillisecond);
+
+
+
+// BATCHED QUERIES: a loop of single stabbing queries vs query_batch with the vector kernels, at 1, 8, 64
+// and 1024 points per batch. Sparse is the STATIC SNAPSHOT workload, dense has the shape of the
+// BM_Parallel/Query cases: few, long intervals, every point hits many of them. The template flag selects
+// the dense workload.
+
+Data<TYP, 1>            DAT1_DENSE(1E4, 0, 100, 1, 0,   1,    0,    0);
+Data<TYP, 1>      DAT1_DENSE_QUERY(1E4, 0, 100, 1, 1,   0,    0,    0);
+
+std::vector<TYP> query_points(const Data<TYP, 1>& DAT) {
+    std::vector<TYP> v;
+    for (auto& tsk : DAT.tsks)
+        v.push_back(tsk.a[0]);
+    return v;
+}
+
+template <class Tree>
+const Tree& dense_tree() {
+    static Tree tree;
+    static bool loaded = [] {
+        std::vector<Interval<TYP, 1>> v;
+        for (auto& tsk : DAT1_DENSE.tsks)
+            v.emplace_back(tsk.a, tsk.b);
+        tree.build(v.begin(), v.end());
+        return true;
+    }();
+    (void)loaded;
+    return tree;
+}
+template <>
+const SIT_Fixed& dense_tree<SIT_Fixed>() {
+    static SIT_Fixed tree(dense_tree<IT_Fixed>());
+    return tree;
+}
+
+template <class Tree, bool dense>
+static void BM_QueryBatch_Loop(benchmark::State& state) {
+    const Tree& t = dense ? dense_tree<Tree>() : static_tree<Tree>();
+    static const std::vector<TYP> sparse_points = query_points(DAT1_STATIC_QUERY), dense_points = query_points(DAT1_DENSE_QUERY);
+    const std::vector<TYP>& points = dense ? dense_points : sparse_points;
+    const size_t batch = state.range(0);
+    std::vector<size_t> counts(batch);
+    for (auto _ : state) {
+        for (size_t i = 0; i + batch <= points.size(); i += batch) {
+            for (size_t j = 0; j < batch; ++j)
+                counts[j] = t.query(points[i + j]);
+            benchmark::DoNotOptimize(counts.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * (points.size() / batch * batch));
+}
+
+template <bool dense>
+static void BM_QueryBatch_SIMD(benchmark::State& state) {
+    const SIT_Fixed& t = dense ? dense_tree<SIT_Fixed>() : static_tree<SIT_Fixed>();
+    static const std::vector<TYP> sparse_points = query_points(DAT1_STATIC_QUERY), dense_points = query_points(DAT1_DENSE_QUERY);
+    const std::vector<TYP>& points = dense ? dense_points : sparse_points;
+    const size_t batch = state.range(0);
+    std::vector<size_t> counts(batch);
+    for (auto _ : state) {
+        for (size_t i = 0; i + batch <= points.size(); i += batch) {
+            t.query_batch(points.data() + i, batch, counts.data());
+            benchmark::DoNotOptimize(counts.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * (points.size() / batch * batch));
+}
+
+BENCHMARK_TEMPLATE(BM_QueryBatch_Loop, IT_Fixed, true)->Arg(1)->Arg(8)->Arg(64)->Arg(1024)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QueryBatch_Loop, SIT_Fixed, true)->Arg(1)->Arg(8)->Arg(64)->Arg(1024)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QueryBatch_SIMD, true)->Arg(1)->Arg(8)->Arg(64)->Arg(1024)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_TEMPLATE(BM_QueryBatch_Loop, IT_Fixed, false)->Arg(1)->Arg(8)->Arg(64)->Arg(1024)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QueryBatch_Loop, SIT_Fixed, false)->Arg(1)->Arg(8)->Arg(64)->Arg(1024)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QueryBatch_SIMD, false)->Arg(1)->Arg(8)->Arg(64)->Arg(1024)->Unit(benchmark::kMillisecond);
+
+
+
+// SHARDS: concurrent inserts of 1E5 short intervals into one ParallelIntervalTree vs a
+// ShardedIntervalTree of 8 range partitions, 1 to 4 threads.
+
+typedef ShardedIntervalTree<TYP, 1> SHT_Fixed;
+
+template <class Tree>
+Tree* make_shard_tree() { return new Tree(); }
+template <>
+SHT_Fixed* make_shard_tree<SHT_Fixed>() { return new SHT_Fixed(8, 0, 1E9); }
+
+template <class Tree>
+static void BM_Shard_Insert(benchmark::State& state) {
+    const size_t threads = state.range(0);
+    const size_t n = 1E5;
+    const std::vector<Interval<TYP, 1>>& intervals = static_intervals();
+    for (auto _ : state) {
+        Tree* t = make_shard_tree<Tree>();
+        std::vector<std::thread> ths;
+        for (size_t i = 0; i < threads; ++i)
+            ths.emplace_back([&, i] {
+                for (size_t j = i; j < n; j += threads)
+                    t->insert(intervals[j]);
+            });
+        for (auto& th : ths)
+            th.join();
+        state.PauseTiming();
+        delete t;
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK_TEMPLATE(BM_Shard_Insert, PIT_Fixed)->DenseRange(1, 4)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shard_Insert, SHT_Fixed)->DenseRange(1, 4)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+
+// SCALING: 1 to 4 threads insert 1E5 short intervals and remove them again. Every operation
+// enters through the root, with no tree wide lock and the node count striped per thread.
+
+template <class Tree>
+static void BM_Scale_InsertRemove(benchmark::State& state) {
+    const size_t threads = state.range(0);
+    const size_t n = 1E5;
+    const std::vector<Interval<TYP, 1>>& intervals = static_intervals();
+    Tree t;
+    for (auto _ : state) {
+        std::vector<std::thread> ths;
+        for (size_t i = 0; i < threads; ++i)
+            ths.emplace_back([&, i] {
+                for (size_t j = i; j < n; j += threads)
+                    t.insert(intervals[j]);
+                for (size_t j = i; j < n; j += threads)
+                    t.remove(intervals[j]);
+            });
+        for (auto& th : ths)
+            th.join();
+    }
+    state.SetItemsProcessed(state.iterations() * 2 * n);
+}
+
+BENCHMARK_TEMPLATE(BM_Scale_InsertRemove, PIT_Fixed)->DenseRange(1, 4)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Scale_InsertRemove, PIT_Slab)->DenseRange(1, 4)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+
+// REMOVE PRUNING: 1E5 intervals, 1% of them long, then 90% removed in random order. Stabbing queries
+// afterwards report the nodes visited per query, the max values are repaired on remove and stay tight.
+
+static void BM_Remove_Visits(benchmark::State& state) {
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<TYP> begin(0, 1E6), length(0, 100);
+    std::vector<Interval<TYP, 1>> intervals;
+    PIT_Fixed t;
+    for (size_t i = 0; i < 1E5; ++i) {
+        const TYP b = begin(gen);
+        intervals.emplace_back(b, b + (i % 100 == 0 ? 200000 : length(gen)));
+        t.insert(intervals.back());
+    }
+    std::shuffle(intervals.begin(), intervals.end(), gen);
+    for (size_t i = 0; i < 9E4; ++i)
+        t.remove(intervals[i]);
+
+    size_t queries = 0, visited = 0;
+    for (auto _ : state) {
+        const Point<TYP, 1> p(begin(gen));
+        benchmark::DoNotOptimize(t.query(p));
+        visited += t.query_visits(p);
+        ++queries;
+    }
+    state.counters["visited/query"] = static_cast<double>(visited) / queries;
+}
+
+BENCHMARK(BM_Remove_Visits);
+
+
+// VERSIONS: long overlap queries, each visiting 1% of 1E5 intervals, while one writer keeps inserting and
+// removing. The readers of ParallelIntervalTree hold read locks the writer has to wait for, the readers
+// of PersistentIntervalTree read a snapshot. writes/s is the writer's progress meanwhile.
+
+typedef PersistentIntervalTree<TYP, 1>  PST_Fixed;
+
+template <class Tree>
+static void BM_Versions_Overlap(benchmark::State& state) {
+    const std::vector<Interval<TYP, 1>>& intervals = static_intervals();
+    const size_t n = 1E5;
+    Tree t;
+    t.build(intervals.begin(), intervals.begin() + n);
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> writes(0);
+    std::thread writer([&] {
+        for (size_t i = n; !stop.load(std::memory_order_relaxed); i = i + 1 < intervals.size() ? i + 1 : n) {
+            t.insert(intervals[i]);
+            t.remove(intervals[i]);
+            writes.fetch_add(2, std::memory_order_relaxed);
+        }
+    });
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<TYP> begin(0, 99E7);
+    const auto start = std::chrono::steady_clock::now();
+    for (auto _ : state) {
+        const TYP a = begin(gen);
+        size_t count = 0;
+        t.visit_overlap(a, a + static_cast<TYP>(1E7), [&count](const Point<TYP, 1>&, const Point<TYP, 1>&, const size_t multip) { count += multip; });
+        benchmark::DoNotOptimize(count);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stop = true;
+    writer.join();
+    state.SetItemsProcessed(state.iterations());
+    state.counters["writes/s"] = writes.load() / seconds;
+}
+
+BENCHMARK_TEMPLATE(BM_Versions_Overlap, PIT_Fixed)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Versions_Overlap, PST_Fixed)->UseRealTime();
+
+
+// COMBINING: concurrent inserts of 1E5 short intervals at 1 to 64 threads, every writer descending on
+// its own (hand-over-hand) vs flat combining, where one combiner applies the posted inserts as a batch.
+
+typedef CombiningIntervalTree<TYP, 1>  CIT_Fixed;
+
+template <class Tree>
+void combining_counters(benchmark::State&, const Tree&) {}
+template <>
+void combining_counters<CIT_Fixed>(benchmark::State& state, const CIT_Fixed& t) {
+    state.counters["inserts/batch"] = static_cast<double>(t.combined()) / std::max<size_t>(1, t.batches());
+}
+
+template <class Tree>
+static void BM_Combining_Insert(benchmark::State& state) {
+    const size_t threads = state.range(0);
+    const size_t n = 1E5;
+    const std::vector<Interval<TYP, 1>>& intervals = static_intervals();
+    for (auto _ : state) {
+        Tree* t = new Tree();
+        std::vector<std::thread> ths;
+        for (size_t i = 0; i < threads; ++i)
+            ths.emplace_back([&, i] {
+                for (size_t j = i; j < n; j += threads)
+                    t->insert(intervals[j]);
+            });
+        for (auto& th : ths)
+            th.join();
+        state.PauseTiming();
+        combining_counters(state, *t);
+        delete t;
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK_TEMPLATE(BM_Combining_Insert, PIT_Fixed)->RangeMultiplier(2)->Range(1, 64)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Combining_Insert, CIT_Fixed)->RangeMultiplier(2)->Range(1, 64)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+
+
+// SKEWED DATA: half queries, half inserts and removes of existing intervals, over hot keys, clustered
+// keys, a sliding time window and lengths with a heavy tail, against uniform keys of the same lengths.
+
+Data<TYP, 1>   DAT1_SHAPE_UNIFORM(1E5, Shape<TYP>{uniform_keys<TYP>(0, 1E6), uniform_lengths<TYP>(1, 100)}, 1, 0.5, 0.3, 0.2, 0);
+Data<TYP, 1>      DAT1_SHAPE_ZIPF(1E5, Shape<TYP>{zipf_keys<TYP>(0, 1E6, 1E4, 1.1), uniform_lengths<TYP>(1, 100)}, 1, 0.5, 0.3, 0.2, 0);
+Data<TYP, 1> DAT1_SHAPE_CLUSTERED(1E5, Shape<TYP>{clustered_keys<TYP>(0, 1E6, 16, 1E3), uniform_lengths<TYP>(1, 100)}, 1, 0.5, 0.3, 0.2, 0);
+Data<TYP, 1>    DAT1_SHAPE_WINDOW(1E5, Shape<TYP>{monotone_keys<TYP>(0, 10), fixed_lengths<TYP>(100), true}, 1, 0.5, 0.3, 0.2, 0);
+Data<TYP, 1> DAT1_SHAPE_HEAVYTAIL(1E5, Shape<TYP>{uniform_keys<TYP>(0, 1E6),
+        mixed_lengths<TYP>(0.01, uniform_lengths<TYP>(1, 100), pareto_lengths<TYP>(1000, 1.2, 1E6))}, 1, 0.5, 0.3, 0.2, 0);
+
+template <class Tree, const Data<TYP, 1>& DAT>
+static void BM_Shape(benchmark::State& state) {
+    for (auto _ : state) {
+        Tree t;
+        for (auto& tsk : DAT.tsks) {
+            switch (tsk.method) {
+            case TaskMethods::QUERY:
+                benchmark::DoNotOptimize(t.query(tsk.a));
+                break;
+            case TaskMethods::INSERT:
+                t.insert(tsk.a, tsk.b);
+                break;
+            case TaskMethods::REMOVE:
+                t.remove(tsk.a, tsk.b);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * DAT.tsks.size());
+}
+
+BENCHMARK_TEMPLATE(BM_Shape, IT_Fixed, DAT1_SHAPE_UNIFORM)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, IT_Fixed, DAT1_SHAPE_ZIPF)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, IT_Fixed, DAT1_SHAPE_CLUSTERED)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, IT_Fixed, DAT1_SHAPE_WINDOW)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, IT_Fixed, DAT1_SHAPE_HEAVYTAIL)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, PIT_Fixed, DAT1_SHAPE_UNIFORM)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, PIT_Fixed, DAT1_SHAPE_ZIPF)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, PIT_Fixed, DAT1_SHAPE_CLUSTERED)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, PIT_Fixed, DAT1_SHAPE_WINDOW)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Shape, PIT_Fixed, DAT1_SHAPE_HEAVYTAIL)->Unit(benchmark::kMillisecond);
+
+
+
+// SNAPSHOTS: startup from n intervals, rebuilding the tree with build vs opening a saved snapshot
+// (open_mapped and one query), at 1E4 to 4E6 intervals.
+
+static const char* SNAPSHOT_PATH = "benchmark_snapshot.bin";
+
+static void BM_Snapshot_Build(benchmark::State& state) {
+    const std::vector<Interval<TYP, 1>>& intervals = static_intervals();
+    const size_t n = state.range(0);
+    for (auto _ : state) {
+        PIT_Fixed t;
+        t.build(intervals.begin(), intervals.begin() + n);
+        benchmark::DoNotOptimize(t.query(intervals[0].begin));
+    }
+}
+
+static void BM_Snapshot_Open(benchmark::State& state) {
+    const std::vector<Interval<TYP, 1>>& intervals = static_intervals();
+    const size_t n = state.range(0);
+    {
+        PIT_Fixed t;
+        t.build(intervals.begin(), intervals.begin() + n);
+        save_snapshot(t, SNAPSHOT_PATH);
+    }
+    for (auto _ : state) {
+        MappedIntervalTree<PIT_Fixed> t;
+        t.open_mapped(SNAPSHOT_PATH);
+        benchmark::DoNotOptimize(t.query(intervals[0].begin));
+    }
+    std::remove(SNAPSHOT_PATH);
+}
+
+BENCHMARK(BM_Snapshot_Build)->RangeMultiplier(10)->Range(1E4, 1E6)->Arg(4E6)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_Snapshot_Open)->RangeMultiplier(10)->Range(1E4, 1E6)->Arg(4E6)->Unit(benchmark::kMicrosecond);
+
+
+// EXPIRY: a sliding time window of about 1E5 intervals, lengths up to 1E3. Every iteration inserts the next
+// 1E4 intervals and expires those ending before the window, one remove each vs one prune_before.
+
+template <class Tree, bool Prune>
+static void BM_Expire(benchmark::State& state) {
+    const size_t WINDOW = 1E5, CHUNK = 1E4;
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<TYP> length(0, 1E3);
+    auto by_end = [](const Interval<TYP, 1>& x, const Interval<TYP, 1>& y) { return x.end[0] < y.end[0]; };
+    std::multiset<Interval<TYP, 1>, decltype(by_end)> live(by_end);
+    Tree t;
+    size_t now = 0;
+    size_t expired = 0;
+    for (auto _ : state) {
+        for (size_t i = 0; i < CHUNK; ++i, ++now) {
+            const Interval<TYP, 1> interval(static_cast<TYP>(now), static_cast<TYP>(now) + length(gen));
+            t.insert(interval);
+            if (!Prune) live.insert(interval);
+        }
+        if (now < WINDOW) continue;
+        const Point<TYP, 1> watermark(static_cast<TYP>(now - WINDOW));
+        if (Prune) {
+            expired += t.prune_before(watermark);
+            continue;
+        }
+        while (!live.empty() && live.begin()->end[0] < watermark[0]) {
+            t.remove(*live.begin());
+            live.erase(live.begin());
+            ++expired;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * CHUNK);
+    state.counters["expired"] = static_cast<double>(expired);
+}
 
+BENCHMARK_TEMPLATE(BM_Expire, IT_Fixed, false)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Expire, IT_Fixed, true)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Expire, PIT_Fixed, false)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Expire, PIT_Fixed, true)->Unit(benchmark::kMillisecond);
 
 BENCHMARK_MAIN();
 
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "pit.hpp"
+
+
+// Flat combining front-end over a ParallelIntervalTree. Writers do not descend themselves: they post
+// their insert or remove to a publication slot and wait. Whoever gets the combiner lock collects every
+// posted request and applies them as one batch (see ParallelIntervalTree::apply_batch): sorted, netted,
+// and sharing one descent, so under contention the root is taken once per batch, not once per writer.
+// Reads go to the tree directly, they take no locks anyway.
+template <typename T, size_t D = DYNAMIC_DIM, class Alloc = HeapAllocator>
+class CombiningIntervalTree {
+public:
+    typedef T value_t;
+    typedef Point<T, D> P;
+    typedef Interval<T, D> I;
+    typedef ParallelIntervalTree<T, D, Alloc> Tree;
+
+    CombiningIntervalTree(const size_t dim) : tree(dim) {}
+    CombiningIntervalTree() : CombiningIntervalTree(1) {}
+
+    void insert(const I &interval) { insert(interval.begin, interval.end); }
+    void insert(const P &begin, const P &end) { post(TaskMethods::INSERT, begin, end); }
+
+    void remove(const I &interval) { remove(interval.begin, interval.end); }
+    void remove(const P &begin, const P &end) { post(TaskMethods::REMOVE, begin, end); }
+
+    template <class InputIt>
+    std::vector<size_t> apply_batch(InputIt first, InputIt last) {
+        std::lock_guard<std::mutex> guard(combiner);
+        return tree.apply_batch(first, last);
+    }
+
+    // Goes to the tree directly like reads, the prune locks only what it changes.
+    size_t prune_before(const P &watermark) { return tree.prune_before(watermark); }
+
+    template <class InputIt>
+    void build(InputIt first, InputIt last) {
+        std::lock_guard<std::mutex> guard(combiner);
+        tree.build(first, last);
+    }
+    void clear() {
+        std::lock_guard<std::mutex> guard(combiner);
+        tree.clear();
+    }
+
+    size_t query(const P &p) const { return tree.query(p); }
+    template <class OutputIt>
+    OutputIt query(const P &p, OutputIt out) const { return tree.query(p, out); }
+    template <class F>
+    void visit(const P &p, F f) const { tree.visit(p, f); }
+
+    template <class OutputIt>
+    OutputIt query_overlap(const P &begin, const P &end, OutputIt out) const { return tree.query_overlap(begin, end, out); }
+    template <class F>
+    void visit_overlap(const P &begin, const P &end, F f) const { tree.visit_overlap(begin, end, f); }
+    size_t count_overlap(const P &begin, const P &end) const { return tree.count_overlap(begin, end); }
+
+    template <class F>
+    void visit_all(F f) const { tree.visit_all(f); }
+
+    // Requests applied so far, and the batches they took.
+    size_t combined() const { return combined_count.load(std::memory_order_relaxed); }
+    size_t batches() const { return batch_count.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t SLOTS = 64;
+
+    enum SlotState { EMPTY, WRITING, PENDING, DONE };
+
+    // Publication slot of the threads with the same thread_index() % SLOTS, one request at a time.
+    struct alignas(64) Slot {
+        std::atomic<int> state{EMPTY};
+        Task<T, D> task;
+    };
+
+    void post(const TaskMethods::methods method, const P &begin, const P &end) {
+        Slot &slot = slots[thread_index() % SLOTS];
+        int expected = EMPTY;
+        while (!slot.state.compare_exchange_weak(expected, WRITING, std::memory_order_acquire)) {
+            expected = EMPTY;
+            std::this_thread::yield();
+        }
+        slot.task.method = method;
+        slot.task.a = begin;
+        slot.task.b = end;
+        slot.state.store(PENDING, std::memory_order_release);
+
+        // Either a combiner picks the request up, or this thread becomes the combiner.
+        while (slot.state.load(std::memory_order_acquire) != DONE) {
+            if (combiner.try_lock()) {
+                combine();
+                combiner.unlock();
+            }
+            else {
+                std::this_thread::yield();
+            }
+        }
+        slot.state.store(EMPTY, std::memory_order_release);
+    }
+
+    // Applies every pending request as one batch. The combiner lock must be held.
+    void combine() {
+        std::vector<Slot*> taken;
+        std::vector<Task<T, D>> tasks;
+        for (Slot &slot : slots) {
+            if (slot.state.load(std::memory_order_acquire) == PENDING) {
+                taken.push_back(&slot);
+                tasks.push_back(slot.task);
+            }
+        }
+        if (tasks.empty()) return;
+        // A lone request has nothing to share, the batch setup would only cost.
+        if (tasks.size() == 1 && tasks[0].method == TaskMethods::INSERT) tree.insert(tasks[0].a, tasks[0].b);
+        else if (tasks.size() == 1) tree.remove(tasks[0].a, tasks[0].b);
+        else tree.apply_batch(tasks.begin(), tasks.end(), 1);
+        for (Slot *slot : taken) slot->state.store(DONE, std::memory_order_release);
+        combined_count.fetch_add(tasks.size(), std::memory_order_relaxed);
+        batch_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    Tree tree;
+    std::mutex combiner;
+    Slot slots[SLOTS];
+    std::atomic<size_t> combined_count{0};
+    std::atomic<size_t> batch_count{0};
+};
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <functional>
 #include <random>
 #include <vector>
 #include <algorithm>
-#include <set>
 
 #include "it.hpp"
 
@@ -24,24 +26,128 @@ typename std::conditional<
 >::type;
 
 
+// Draws one coordinate: the begin of an interval or a query point, or the length of an interval.
+// Samplers may keep state between draws (see monotone_keys), each Data holds its own copy.
 template<typename T>
-class Data {
-public:
-    enum methods { QUERY, INSERT, REMOVE, NOOP };
-    struct task {
-        methods method = NOOP;
-        Point<T> a, b;
+using Sampler = std::function<T(std::mt19937&)>;
+
+// Shape of the generated data beyond the uniform default (see the samplers below).
+template<typename T>
+struct Shape {
+    // Begins of intervals and query points, the same for every dimension. Unset, uniform in [0,1] like the
+    // defaults of Data.
+    Sampler<T> keys;
+    // Lengths of intervals. Unset, the end is a second key and the two are ordered, like uniform data.
+    Sampler<T> lengths;
+    // Existing removes take the oldest removable interval instead of a random one: with monotone keys
+    // intervals expire in time order, a sliding window.
+    bool expire_oldest = false;
+};
+
+template<typename T>
+Sampler<T> uniform_keys(const T a, const T b) {
+    return [dist = uniform_distribution<T>(a, b)](std::mt19937 &gen) mutable { return dist(gen); };
+}
+
+// Hot keys: [a,b] is cut into n cells, the k-th most popular is hit with a probability of 1/k^s.
+// Popularity is not tied to position, the ranks are shuffled over the cells.
+template<typename T>
+Sampler<T> zipf_keys(const T a, const T b, const size_t n, const double s = 1.0, const uint32_t seed = 7) {
+    std::vector<double> cdf(n);
+    double sum = 0;
+    for (size_t k = 0; k < n; ++k) cdf[k] = sum += 1.0 / std::pow(static_cast<double>(k + 1), s);
+    std::vector<T> cells(n);
+    for (size_t k = 0; k < n; ++k) cells[k] = static_cast<T>(a + (b - a) * (static_cast<double>(k) / n));
+    std::mt19937 shuffle_gen(seed);
+    std::shuffle(cells.begin(), cells.end(), shuffle_gen);
+    return [cdf = std::move(cdf), cells = std::move(cells), rank = std::uniform_real_distribution<double>(0, sum)](std::mt19937 &gen) mutable {
+        const size_t k = std::lower_bound(cdf.begin(), cdf.end(), rank(gen)) - cdf.begin();
+        return cells[std::min(k, cells.size() - 1)];
+    };
+}
+
+// Keys gathered around `clusters` uniformly placed centers, normally spread by sigma, kept in [a,b].
+template<typename T>
+Sampler<T> clustered_keys(const T a, const T b, const size_t clusters, const double sigma, const uint32_t seed = 7) {
+    std::mt19937 center_gen(seed);
+    std::uniform_real_distribution<double> center_dist(a, b);
+    std::vector<double> centers(clusters);
+    for (double &c : centers) c = center_dist(center_gen);
+    return [=, pick = std::uniform_int_distribution<size_t>(0, clusters - 1), spread = std::normal_distribution<double>(0, sigma)](std::mt19937 &gen) mutable {
+        const double x = centers[pick(gen)] + spread(gen);
+        return static_cast<T>(std::min<double>(std::max<double>(x, a), b));
+    };
+}
+
+// Timestamps: every draw advances the clock from `start` by an exponential step of mean `step`, so
+// inserts arrive in time order and queries hit the recent past.
+template<typename T>
+Sampler<T> monotone_keys(const T start, const double step) {
+    return [now = static_cast<double>(start), tick = std::exponential_distribution<double>(1.0 / step)](std::mt19937 &gen) mutable {
+        now += tick(gen);
+        return static_cast<T>(now);
+    };
+}
+
+template<typename T>
+Sampler<T> fixed_lengths(const T length) {
+    return [=](std::mt19937&) { return length; };
+}
+
+template<typename T>
+Sampler<T> uniform_lengths(const T lo, const T hi) {
+    return uniform_keys<T>(lo, hi);
+}
+
+template<typename T>
+Sampler<T> exponential_lengths(const double mean) {
+    return [dist = std::exponential_distribution<double>(1.0 / mean)](std::mt19937 &gen) mutable { return static_cast<T>(dist(gen)); };
+}
+
+// Heavy tail: lengths from lo up, P(length > x) = (lo/x)^alpha, cut at hi.
+template<typename T>
+Sampler<T> pareto_lengths(const T lo, const double alpha, const T hi) {
+    return [=, u = std::uniform_real_distribution<double>(0, 1)](std::mt19937 &gen) mutable {
+        const double x = lo / std::pow(1.0 - u(gen), 1.0 / alpha);
+        return static_cast<T>(std::min<double>(x, hi));
+    };
+}
+
+// Mostly short intervals and a share p_long of long ones.
+template<typename T>
+Sampler<T> mixed_lengths(const double p_long, Sampler<T> short_lengths, Sampler<T> long_lengths) {
+    return [=, u = std::uniform_real_distribution<double>(0, 1)](std::mt19937 &gen) mutable {
+        return u(gen) < p_long ? long_lengths(gen) : short_lengths(gen);
     };
+}
+
+
+template<typename T, size_t D = DYNAMIC_DIM>
+class Data : public TaskMethods {
+public:
+    typedef Point<T, D> P;
+    typedef Interval<T, D> I;
+    typedef Task<T, D> task;
     
+    // For a fixed dimension D the dim argument is ignored.
     Data(const size_t N, const T a = 0, const T b = 1, const size_t dim = 1, const double qry = 0.8, const double ins = 0.15, const double erm = 0.04, const double rrm = 0.01, const uint32_t seed = 1)
-    : N(N), dim(dim), tsks(N), gen(seed), p_dist(a, b), t_dist(0.0, 1.0) {
+    : tsks(N), N(N), dim(D == DYNAMIC_DIM ? dim : D), gen(seed), p_dist(a, b), t_dist(0.0, 1.0) {
+        generate(N, qry, ins, erm, rrm);
+    }
+
+    // Keys and lengths from the samplers of the shape instead of uniform in [a,b].
+    Data(const size_t N, const Shape<T> &shape, const size_t dim = 1, const double qry = 0.8, const double ins = 0.15, const double erm = 0.04, const double rrm = 0.01, const uint32_t seed = 1)
+    : tsks(N), N(N), dim(D == DYNAMIC_DIM ? dim : D), gen(seed), t_dist(0.0, 1.0),
+      keys(shape.keys ? shape.keys : uniform_keys<T>(0, 1)), lengths(shape.lengths), expire_oldest(shape.expire_oldest) {
         generate(N, qry, ins, erm, rrm);
     }
 
     void generate(const size_t N, const double qry, const double ins, const double erm, const double rrm) {
         tsks.resize(N);
         size_t removable_limit = N*(erm+rrm);
-        std::set<Interval<T>> removable;
+        // Removable intervals live in removable[oldest..], a pick swaps with the last one: O(1) either way.
+        std::vector<I> removable;
+        size_t oldest = 0;
         for (size_t i = 0; i < N; ++i) {
             double tsk = t_dist(gen);
             if (tsk < qry) {
@@ -52,22 +158,23 @@ public:
 
             } else if (tsk < qry + ins) {
                 // insert
-                Interval<T> iv = generate_interval();
+                I iv = generate_interval();
                 tsks[i].method = INSERT;
                 tsks[i].a = iv.begin;
                 tsks[i].b = iv.end;
                 //std::cout << "insert " << iv.begin[0] << ' ' << iv.end[0] << std::endl;
-                if (tsk < qry + ins + erm && removable.size() < removable_limit) {
-                    removable.insert(iv);
+                if (tsk < qry + ins + erm && removable.size() - oldest < removable_limit) {
+                    removable.push_back(iv);
                 }
 
-            } else if (removable.size()) {
+            } else if (removable.size() > oldest) {
                 // existing remove
-                size_t ith = std::uniform_int_distribution<int>(0,removable.size()-1)(gen);
-                auto it = std::begin(removable);
-                std::advance(it, ith);
-                Interval<int> iv = *it;
-                removable.erase(it);
+                size_t ith = expire_oldest ? oldest++ : std::uniform_int_distribution<size_t>(oldest, removable.size()-1)(gen);
+                I iv = std::move(removable[ith]);
+                if (!expire_oldest) {
+                    removable[ith] = std::move(removable.back());
+                    removable.pop_back();
+                }
                 tsks[i].method = REMOVE;
                 tsks[i].a = iv.begin;
                 tsks[i].b = iv.end;
@@ -75,7 +182,7 @@ public:
 
             } else {
                 // random remove
-                Interval<T> iv = generate_interval();
+                I iv = generate_interval();
                 tsks[i].method = REMOVE;
                 tsks[i].a = iv.begin;
                 tsks[i].b = iv.end;
@@ -85,25 +192,36 @@ public:
         }
     }
 
-    Point<T> generate_point() {
-        Point<T> p;
-        p.reserve(dim);
+    P generate_point() {
+        P p = make_point();
         for (size_t d = 0; d < dim; ++d) {
-            p.emplace_back(p_dist(gen));
+            p[d] = keys ? keys(gen) : p_dist(gen);
         }
         return p;
     }
 
-    Interval<T> generate_interval() {
-        Point<T> p_a, p_b;
-        p_a.reserve(dim);
-        p_b.reserve(dim);
+    I generate_interval() {
+        P p_a = make_point(), p_b = make_point();
         for (size_t j = 0; j < dim; ++j) {
-            T a = p_dist(gen), b = p_dist(gen);
-            p_a.emplace_back(std::min(a,b));
-            p_b.emplace_back(std::max(a,b));
+            if (keys && lengths) {
+                p_a[j] = keys(gen);
+                p_b[j] = p_a[j] + lengths(gen);
+                continue;
+            }
+            T a = keys ? keys(gen) : p_dist(gen), b = keys ? keys(gen) : p_dist(gen);
+            p_a[j] = std::min(a,b);
+            p_b[j] = std::max(a,b);
         }
-        return Interval<T>(p_a, p_b);
+        return I(p_a, p_b);
+    }
+
+    P make_point() const {
+        P p;
+        if constexpr (D == DYNAMIC_DIM) {
+            p.resize(dim);
+            p.dim = dim;
+        }
+        return p;
     }
 
 public:
@@ -114,5 +232,7 @@ private:
     std::mt19937 gen;
     uniform_distribution<T> p_dist;
     std::uniform_real_distribution<double> t_dist;
+    Sampler<T> keys, lengths;
+    bool expire_oldest = false;
 };
 
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <vector>
+
+
+// Epoch based memory reclamation.
+// Readers pin the domain while they may follow pointers to shared objects. Unlinked objects are retired
+// into the limbo list of the retiring thread, tagged with the global epoch, and freed once the global
+// epoch is two steps further: the epoch only advances when every pinned thread has seen the current
+// one, so by then no reader can still hold a pointer to them.
+class EpochDomain {
+    struct Record;
+public:
+    typedef void (*deleter_t)(void *ptr, void *context);
+
+    // Pins the domain for the lifetime of the guard, guards may be nested.
+    class Guard {
+    public:
+        explicit Guard(EpochDomain &domain) : record(domain.local_record()) {
+            if (record->nesting++ == 0) {
+                record->state.exchange(domain.global_epoch.load(std::memory_order_seq_cst) << 1 | ACTIVE, std::memory_order_seq_cst);
+            }
+        }
+        ~Guard() {
+            if (--record->nesting == 0) {
+                record->state.store(record->state.load(std::memory_order_relaxed) & ~ACTIVE, std::memory_order_release);
+            }
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    private:
+        Record *record;
+    };
+
+    EpochDomain() : id(next_id()) {
+        std::lock_guard<std::mutex> guard(registry_lock());
+        live_domains().insert(id);
+    }
+
+    // No thread may use the domain anymore, everything still in limbo is freed.
+    ~EpochDomain() {
+        {
+            std::lock_guard<std::mutex> guard(registry_lock());
+            live_domains().erase(id);
+        }
+        Record *record = records.load(std::memory_order_acquire);
+        while (record != nullptr) {
+            for (Retired &r : record->limbo) {
+                r.deleter(r.ptr, r.context);
+                reclaimed_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            Record *next = record->next;
+            delete record;
+            record = next;
+        }
+    }
+
+    Guard pin() { return Guard(*this); }
+
+    // ptr must already be unreachable for new readers, deleter(ptr, context) is called once it is safe.
+    void retire(void *ptr, deleter_t deleter, void *context = nullptr) {
+        Record *record = local_record();
+        record->limbo.push_back({ptr, deleter, context, global_epoch.load(std::memory_order_seq_cst)});
+        retired_count.fetch_add(1, std::memory_order_relaxed);
+        if (record->limbo.size() % RECLAIM_THRESHOLD == 0) {
+            try_advance();
+            reclaim(record);
+        }
+    }
+
+    size_t retired() const { return retired_count.load(std::memory_order_relaxed); }
+    size_t reclaimed() const { return reclaimed_count.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr uint64_t ACTIVE = 1;
+    static constexpr size_t RECLAIM_THRESHOLD = 64;
+
+    struct Retired {
+        void *ptr;
+        deleter_t deleter;
+        void *context;
+        uint64_t epoch;
+    };
+
+    // One per thread and domain, the limbo list is only touched by the owner thread.
+    // Records of exited threads are reused, together with their limbo lists.
+    struct alignas(64) Record {
+        std::atomic<uint64_t> state{0};
+        std::atomic<bool> in_use{true};
+        size_t nesting = 0;
+        std::vector<Retired> limbo;
+        Record *next = nullptr;
+    };
+
+    // The domains a thread has a record in. On thread exit the records of live domains are released.
+    struct RecordCache {
+        struct Entry {
+            uint64_t id;
+            Record *record;
+        };
+        std::vector<Entry> entries;
+        ~RecordCache() {
+            std::lock_guard<std::mutex> guard(registry_lock());
+            for (Entry &e : entries) {
+                if (live_domains().count(e.id)) e.record->in_use.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    Record *local_record() {
+        thread_local RecordCache cache;
+        for (auto &e : cache.entries) {
+            if (e.id == id) return e.record;
+        }
+        {
+            // Drop the entries of destroyed domains, their ids are never reused.
+            std::lock_guard<std::mutex> guard(registry_lock());
+            auto &live = live_domains();
+            cache.entries.erase(std::remove_if(cache.entries.begin(), cache.entries.end(),
+                [&live](const RecordCache::Entry &e) { return live.count(e.id) == 0; }), cache.entries.end());
+        }
+        Record *record = acquire_record();
+        cache.entries.push_back({id, record});
+        return record;
+    }
+
+    Record *acquire_record() {
+        for (Record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+            bool expected = false;
+            if (!record->in_use.load(std::memory_order_relaxed) && record->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return record;
+            }
+        }
+        Record *record = new Record();
+        record->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) {}
+        return record;
+    }
+
+    // The epoch can advance once every pinned thread runs in the current epoch.
+    void try_advance() {
+        uint64_t epoch = global_epoch.load(std::memory_order_seq_cst);
+        for (Record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+            uint64_t state = record->state.load(std::memory_order_seq_cst);
+            if ((state & ACTIVE) && (state >> 1) != epoch) return;
+        }
+        global_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+    }
+
+    void reclaim(Record *record) {
+        const uint64_t epoch = global_epoch.load(std::memory_order_seq_cst);
+        auto safe = std::partition(record->limbo.begin(), record->limbo.end(),
+            [epoch](const Retired &r) { return r.epoch + 2 > epoch; });
+        for (auto it = safe; it != record->limbo.end(); ++it) {
+            it->deleter(it->ptr, it->context);
+        }
+        reclaimed_count.fetch_add(record->limbo.end() - safe, std::memory_order_relaxed);
+        record->limbo.erase(safe, record->limbo.end());
+    }
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> ids(0);
+        return ids.fetch_add(1, std::memory_order_relaxed);
+    }
+    static std::mutex &registry_lock() {
+        static std::mutex mtx;
+        return mtx;
+    }
+    static std::set<uint64_t> &live_domains() {
+        static std::set<uint64_t> ids;
+        return ids;
+    }
+
+private:
+    const uint64_t id;
+    std::atomic<uint64_t> global_epoch{0};
+    std::atomic<Record*> records{nullptr};
+    std::atomic<size_t> retired_count{0};
+    std::atomic<size_t> reclaimed_count{0};
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Building blocks of the benchmarks (see scalebench.cpp and benchmark.cpp): persistent worker threads
+// released together, and latency histograms that merge across threads.
+
+
+// Worker threads created once and reused by every run. A run wakes them all, waits until each one is
+// up, then releases them at once and times until the last one finishes: neither thread creation nor
+// the skew of their wake-ups is part of the measured time.
+class WorkerPool {
+public:
+    explicit WorkerPool(const size_t threads) {
+        for (size_t i = 0; i < threads; ++i) workers.emplace_back([this, i] { work(i); });
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+            ++generation;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers) worker.join();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Runs f(i) on every worker i from a common start, returns the seconds from the start to the last finish.
+    double run(std::function<void(size_t)> f) {
+        ready.store(0, std::memory_order_relaxed);
+        running.store(workers.size(), std::memory_order_relaxed);
+        go.store(false, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            job = std::move(f);
+            ++generation;
+        }
+        wake.notify_all();
+        // The barrier: nobody starts until every worker is waiting on go.
+        while (ready.load(std::memory_order_acquire) != workers.size()) std::this_thread::yield();
+        const auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        while (running.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+        const auto stop = std::chrono::steady_clock::now();
+        return std::chrono::duration<double>(stop - start).count();
+    }
+
+private:
+    void work(const size_t i) {
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return generation != seen; });
+                seen = generation;
+                if (stopping) return;
+            }
+            ready.fetch_add(1, std::memory_order_acq_rel);
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            job(i);
+            running.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    size_t generation = 0;
+    bool stopping = false;
+    std::function<void(size_t)> job;
+    std::atomic<size_t> ready{0};
+    std::atomic<size_t> running{0};
+    std::atomic<bool> go{false};
+};
+
+
+// Log-linear histogram of nanosecond latencies: every power of two is split into 2^SUB_BITS buckets,
+// so a percentile is off by at most 1/32 of its value, in constant space whatever the range.
+// One per thread and operation, merged after the run.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts(BUCKETS, 0) {}
+
+    void record(const uint64_t ns) {
+        ++counts[index(ns)];
+        ++total;
+        if (largest < ns) largest = ns;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (size_t i = 0; i < BUCKETS; ++i) counts[i] += other.counts[i];
+        total += other.total;
+        if (largest < other.largest) largest = other.largest;
+    }
+
+    size_t count() const { return total; }
+    uint64_t max() const { return largest; }
+
+    // The latency at quantile q (0.5 is the median): upper bound of the bucket holding that rank.
+    uint64_t percentile(const double q) const {
+        if (total == 0) return 0;
+        const size_t rank = static_cast<size_t>(q * (total - 1)) + 1;
+        size_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(upper(i), largest);
+        }
+        return largest;
+    }
+
+    std::string json() const {
+        std::ostringstream out;
+        out << "{\"count\":" << total << ",\"p50\":" << percentile(0.5) << ",\"p99\":" << percentile(0.99)
+            << ",\"p999\":" << percentile(0.999) << ",\"max\":" << largest << "}";
+        return out.str();
+    }
+
+private:
+    static constexpr int SUB_BITS = 5;
+    static constexpr uint64_t SUB = uint64_t(1) << SUB_BITS;
+    static constexpr size_t BUCKETS = (65 - SUB_BITS) << SUB_BITS;
+
+    // Values below 2*SUB have a bucket each, above that the top SUB_BITS+1 bits select it.
+    static size_t index(const uint64_t v) {
+        if (v < 2 * SUB) return v;
+        const int e = 63 - __builtin_clzll(v);
+        const uint64_t m = v >> (e - SUB_BITS);
+        return ((e - SUB_BITS + 1) << SUB_BITS) + (m - SUB);
+    }
+    static uint64_t upper(const size_t i) {
+        if (i < 2 * SUB) return i;
+        const int e = static_cast<int>(i >> SUB_BITS) + SUB_BITS - 1;
+        const uint64_t m = (i & (SUB - 1)) + SUB;
+        return ((m + 1) << (e - SUB_BITS)) - 1;
+    }
+
+private:
+    std::vector<uint64_t> counts;
+    size_t total = 0;
+    uint64_t largest = 0;
+};
@@ -1,11 +1,18 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <array>
 #include <algorithm>
 #include <iostream>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "alloc.hpp"
+#include "stats.hpp"
+
 
 template <typename T>
 T &max(T&& a, T&& b) {
@@ -14,35 +21,163 @@ T &max(T&& a, T&& b) {
 }
 
 
+// Dimension argument selecting the runtime-sized, std::vector backed Point.
+constexpr size_t DYNAMIC_DIM = 0;
+
+
+// Fixed dimension Point, the coordinates are stored inline (no heap allocation).
+template <typename T, size_t D = DYNAMIC_DIM>
+class Point : public std::array<T, D> {
+public:
+    Point(const T &p1) { this->fill(p1); }
+    Point(std::initializer_list<T> il) : std::array<T, D>() {
+        std::copy_n(il.begin(), std::min(il.size(), D), std::array<T, D>::begin());
+    }
+    Point() : std::array<T, D>() {}
+
+    // The 1D case compares as a plain scalar, higher dimensions lexicographically.
+    friend bool operator<(const Point &a, const Point &b) {
+        if constexpr (D == 1) return a[0] < b[0];
+        else return std::lexicographical_compare(a.cbegin(), a.cend(), b.cbegin(), b.cend());
+    }
+    friend bool operator==(const Point &a, const Point &b) {
+        if constexpr (D == 1) return a[0] == b[0];
+        else return std::equal(a.cbegin(), a.cend(), b.cbegin());
+    }
+    friend bool operator!=(const Point &a, const Point &b) { return !(a == b); }
+    friend bool operator>(const Point &a, const Point &b) { return b < a; }
+    friend bool operator<=(const Point &a, const Point &b) { return !(b < a); }
+    friend bool operator>=(const Point &a, const Point &b) { return !(a < b); }
+public:
+    static constexpr size_t dim = D;
+};
+
+
 template <typename T>
-class Point : public std::vector<T> {
+class Point<T, DYNAMIC_DIM> : public std::vector<T> {
 public:
     Point(const T &p1) : std::vector<T>({p1}), dim(1) { }
     Point(std::initializer_list<T> il) : std::vector<T>(il), dim(il.size()) {}
     Point(const Point<T> &p) : std::vector<T>(p), dim(p.dim) {}
-    Point() {}
+    Point(Point<T> &&p) noexcept : std::vector<T>(std::move(p)), dim(p.dim) {}
+    Point() : dim(0) {}
 
     Point<T>& operator=(const Point<T>& p) {
         std::vector<T>::operator=(p);
         dim = p.dim;
         return *this;
     }
+    Point<T>& operator=(Point<T>&& p) noexcept {
+        std::vector<T>::operator=(std::move(p));
+        dim = p.dim;
+        return *this;
+    }
 public:
     size_t dim;
 };
 
 
-template <typename T>
+// Value type and dimension of a Point type.
+template <class P>
+struct PointTraits;
+template <typename T, size_t D>
+struct PointTraits<Point<T, D>> {
+    typedef T value_t;
+    static constexpr size_t dim = D;
+};
+
+
+// Key order of the trees: by begin, then by end.
+// Intervals with equal begin may end up in either subtree after rotations, so the end has to break ties.
+template <class P>
+bool interval_less(const P &begin1, const P &end1, const P &begin2, const P &end2) {
+    if (begin1 < begin2) return true;
+    else if (begin2 < begin1) return false;
+    else return (end1 < end2);
+}
+
+
+// Intervals of D dimensions are boxes: [begin, end) contains p when begin[d] <= p[d] < end[d] in every dimension.
+// Along the key order only begin[0] is monotonic, it bounds the right subtrees. The max of a subtree is the
+// componentwise maximum of its ends, a point reaching it in any dimension is outside every box below.
+
+// a[d] < b[d] in every dimension
+template <typename T, size_t D>
+bool all_less(const Point<T, D> &a, const Point<T, D> &b) {
+    const size_t dim = std::min(a.size(), b.size());
+    for (size_t d = 0; d < dim; ++d) {
+        if (!(a[d] < b[d])) return false;
+    }
+    return true;
+}
+
+// a[d] <= b[d] in every dimension
+template <typename T, size_t D>
+bool all_less_equal(const Point<T, D> &a, const Point<T, D> &b) {
+    const size_t dim = std::min(a.size(), b.size());
+    for (size_t d = 0; d < dim; ++d) {
+        if (b[d] < a[d]) return false;
+    }
+    return true;
+}
+
+// Raises max to the componentwise maximum of max and p.
+template <typename T, size_t D>
+void extend_max(Point<T, D> &max, const Point<T, D> &p) {
+    const size_t dim = std::min(max.size(), p.size());
+    for (size_t d = 0; d < dim; ++d) {
+        if (max[d] < p[d]) max[d] = p[d];
+    }
+}
+
+// Sets max in place to the componentwise maximum of end and the children maxes present,
+// returns whether it changed. No temporary Point, a vector backed max keeps its buffer.
+template <typename T, size_t D>
+bool assign_max(Point<T, D> &max, const Point<T, D> &end, const Point<T, D> *left, const Point<T, D> *right) {
+    bool changed = false;
+    const size_t dim = std::min(max.size(), end.size());
+    for (size_t d = 0; d < dim; ++d) {
+        T m = end[d];
+        if (left && d < left->size() && m < (*left)[d]) m = (*left)[d];
+        if (right && d < right->size() && m < (*right)[d]) m = (*right)[d];
+        if (max[d] < m || m < max[d]) {
+            max[d] = m;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Sets low in place to the least end[0] of the node and the children lows present, returns whether it changed.
+// begin[0] bounds the right subtrees from below, low bounds every end below: nothing in a subtree whose low
+// is not under w[0] ends before w.
+template <typename T, size_t D>
+bool assign_low(T &low, const Point<T, D> &end, const T *left, const T *right) {
+    T m = end[0];
+    if (left && *left < m) m = *left;
+    if (right && *right < m) m = *right;
+    const bool changed = low < m || m < low;
+    low = m;
+    return changed;
+}
+
+// The box [begin, end) overlaps [a, b), or [a, b] when closed (a == b is a stabbing query).
+template <class P>
+bool box_overlaps(const P &begin, const P &end, const P &a, const P &b, const bool closed) {
+    return (closed ? all_less_equal(begin, b) : all_less(begin, b)) && all_less(a, end);
+}
+
+
+template <typename T, size_t D = DYNAMIC_DIM>
 class Interval {
 public:
     typedef T value_t;
-    typedef Point<T> P;
-    Interval(const P &begin, const P &end) : begin(begin), end(end), dim(max(begin.dim,end.dim)) {}
+    typedef Point<T, D> P;
+    Interval(const P &begin, const P &end) : dim(max(begin.dim,end.dim)), begin(begin), end(end) {}
+    Interval(P &&begin, P &&end) : dim(max(begin.dim,end.dim)), begin(std::move(begin)), end(std::move(end)) {}
 
-    bool operator<(const Interval<T> &other) const {
-        if (begin < other.begin) return true;
-        else if (other.begin < begin) return false;
-        else return (end < other.end);
+    bool operator<(const Interval<T, D> &other) const {
+        return interval_less(begin, end, other.begin, other.end);
     }
     
 public:
@@ -52,28 +187,133 @@ public:
 };
 
 
+// One operation of a batch, or of a generated workload (see datagen.hpp):
+// a stabbing query at a, or the insert or remove of the interval [a,b).
+struct TaskMethods {
+    enum methods { QUERY, INSERT, REMOVE, NOOP };
+};
+
+template <typename T, size_t D = DYNAMIC_DIM>
+struct Task : TaskMethods {
+    methods method = NOOP;
+    Point<T, D> a, b;
+};
+
+
+// Sorts on up to `threads` threads: both halves are sorted in parallel, then merged.
+template <class It, class Compare>
+void parallel_sort(It first, It last, Compare comp, const size_t threads = std::thread::hardware_concurrency()) {
+    const size_t n = last - first;
+    if (threads < 2 || n < (1 << 15)) {
+        std::sort(first, last, comp);
+        return;
+    }
+    It mid = first + n / 2;
+    std::thread th([=]() { parallel_sort(first, mid, comp, threads / 2); });
+    parallel_sort(mid, last, comp, threads - threads / 2);
+    th.join();
+    std::inplace_merge(first, mid, last, comp);
+}
+
+// Sorts the intervals in key order and collapses duplicates, returns the multiplicity of each one kept.
+template <class I>
+std::vector<size_t> sort_collapse(std::vector<I> &intervals) {
+    parallel_sort(intervals.begin(), intervals.end(), [](const I &a, const I &b) { return a < b; });
+    std::vector<size_t> multips;
+    size_t n = 0;
+    for (size_t i = 0; i < intervals.size(); ++i) {
+        if (n > 0 && intervals[n-1].begin == intervals[i].begin && intervals[n-1].end == intervals[i].end) {
+            ++multips.back();
+            continue;
+        }
+        if (n != i) intervals[n] = intervals[i];
+        multips.push_back(1);
+        ++n;
+    }
+    intervals.erase(intervals.begin() + n, intervals.end());
+    return multips;
+}
+
+
+// Explicit stack of the iterative tree walks. The first N entries are kept inline, so walks of
+// balanced trees never allocate; a deep or degenerate tree spills to the heap instead of the call stack.
+// T is a pointer or a plain struct, the inline entries are left uninitialized.
+template <class T, size_t N = 64>
+class TraversalStack {
+public:
+    void push(const T &value) {
+        if (count < N) items[count] = value;
+        else spill.push_back(value);
+        ++count;
+    }
+    T pop() {
+        --count;
+        if (count < N) return items[count];
+        T value = spill.back();
+        spill.pop_back();
+        return value;
+    }
+    T &top() { return count <= N ? items[count-1] : spill.back(); }
+    void clear() {
+        count = 0;
+        spill.clear();
+    }
+    bool empty() const { return count == 0; }
+    // The next push would spill
+    bool full() const { return count >= N; }
+    size_t size() const { return count; }
+
+private:
+    T items[N];
+    std::vector<T> spill;
+    size_t count = 0;
+};
+
+// Frees a subtree in O(1) extra space whatever its shape: a node goes as soon as its links are read,
+// its right child waits on the inline part of a stack. Once that is full, right rotations lift the
+// left subtree instead, until the node has a single child to continue with.
+// before(node) runs right before each node is destroyed.
+template <class Alloc, class Node, class Before>
+void free_subtree(Alloc &alloc, Node *node, Before before) {
+    TraversalStack<Node*> stack;
+    while (node != nullptr || !stack.empty()) {
+        if (node == nullptr) node = stack.pop();
+        Node *left = node->left, *right = node->right;
+        if (left != nullptr && right != nullptr) {
+            if (stack.full()) {
+                node->left = left->right;
+                left->right = node;
+                node = left;
+                continue;
+            }
+            stack.push(right);
+            right = nullptr;
+        }
+        before(node);
+        alloc.destroy(node);
+        node = left != nullptr ? left : right;
+    }
+}
+
+
 template <class Interval, typename T = typename Interval::value_t>
 class IntervalTreeNode {
 public:
     typedef T value_t;
-    typedef Point<T> P;
+    typedef typename Interval::P P;
     typedef Interval I;
-    IntervalTreeNode(const P &begin, const P &end, IntervalTreeNode* left, IntervalTreeNode *right) : begin(begin), end(end), max(end), multip(1), height(1), left(left), right(right) {}
+    IntervalTreeNode(const P &begin, const P &end, IntervalTreeNode* left, IntervalTreeNode *right) : begin(begin), end(end), max(end), low(end[0]), multip(1), height(1), left(left), right(right) {}
     IntervalTreeNode(const P &begin, const P &end) : IntervalTreeNode(begin, end, nullptr, nullptr) {}
+    // Takes over the endpoints, only max is a copy.
+    IntervalTreeNode(P &&begin, P &&end) : begin(std::move(begin)), end(std::move(end)), max(this->end), low(this->end[0]), multip(1), height(1), left(nullptr), right(nullptr) {}
     IntervalTreeNode(const Interval &I, IntervalTreeNode* left, IntervalTreeNode *right) : IntervalTreeNode(I.begin, I.end, left, right) {}
     IntervalTreeNode(const Interval &I) : IntervalTreeNode(I.begin, I.end, nullptr, nullptr) {}
-    ~IntervalTreeNode() {
-        if (left != nullptr) {
-            delete left; 
-        }
-        if (right != nullptr) {
-            delete right;
-        }
-    }
 public:
     P begin;
     P end;
     P max;
+    // Least end[0] of the subtree, see assign_low.
+    T low;
     size_t multip;
     int height;
     IntervalTreeNode *left, *right;
@@ -85,23 +325,105 @@ public:
 // NOTE: https://www.guru99.com/avl-tree.html
 // NOTE: http://www.davismol.net/2016/02/07/data-structures-augmented-interval-tree-to-search-for-interval-overlapping/
 
-template <typename T>
+template <typename T, size_t D = DYNAMIC_DIM, class Alloc = HeapAllocator>
 class IntervalTree {
 public:
     typedef T value_t;
-    typedef Point<T> P;
-    typedef Interval<T> I;
-    typedef IntervalTreeNode<Interval<T>> Node;
+    typedef Point<T, D> P;
+    typedef Interval<T, D> I;
+    typedef IntervalTreeNode<I> Node;
     IntervalTree(const size_t dim) : dim(dim) {}
     IntervalTree() : IntervalTree(1) {}
 
     void insert(const I &interval) { insert(interval.begin, interval.end); }
-    void insert(const P &begin, const P &end) { root = node_insert(root, begin, end); }
+    void insert(I &&interval) { insert(std::move(interval.begin), std::move(interval.end)); }
+    void insert(const P &begin, const P &end) { root = node_insert(root, begin, end, 1); }
+    // The endpoints are moved into the new node, and left as they are if the interval is already stored.
+    void insert(P &&begin, P &&end) { root = node_insert(root, std::move(begin), std::move(end), 1); }
+    // Inserts I(args...)
+    template <class... Args>
+    void emplace(Args&&... args) { insert(I(std::forward<Args>(args)...)); }
 
     void remove(const I &interval) { remove(interval.begin, interval.end); }
     void remove(const P &begin, const P &end) { root = node_remove(root, begin, end); }
 
-    size_t query(const P &p) { return node_query(root, p); }
+    // Removes every interval ending before watermark, all_less(end, watermark), in one pass: subtrees whose
+    // max is below the watermark go at once, the ones whose low is not are skipped. Returns how many intervals
+    // were removed, copies included.
+    size_t prune_before(const P &watermark) {
+        size_t pruned = 0;
+        root = node_prune(root, watermark, pruned);
+        return pruned;
+    }
+
+    // Replaces the contents with the intervals of [first, last): sorted, duplicates collapsed,
+    // then built perfectly balanced in one pass.
+    template <class InputIt>
+    void build(InputIt first, InputIt last) {
+        TreeStats::Timer timer(tree_stats, STAT_BUILD_NS);
+        tree_stats.add(STAT_BUILDS);
+        std::vector<I> intervals(first, last);
+        const std::vector<size_t> multips = sort_collapse(intervals);
+        clear();
+        root = node_build(intervals, multips, 0, intervals.size());
+    }
+
+    // Replaces the contents with sorted, distinct intervals stored multips[i] times each.
+    void build_sorted(const std::vector<I> &intervals, const std::vector<size_t> &multips) {
+        TreeStats::Timer timer(tree_stats, STAT_BUILD_NS);
+        tree_stats.add(STAT_BUILDS);
+        clear();
+        root = node_build(intervals, multips, 0, intervals.size());
+    }
+
+    // Removes every interval. With an allocator releasing in bulk, the nodes are dropped at once.
+    void clear() {
+        node_free_all(root);
+        root = nullptr;
+    }
+
+    size_t query(const P &p) const {
+        tree_stats.add(STAT_QUERIES);
+        return node_query(root, p);
+    }
+
+    // Intervals containing p, or overlapping [begin,end). An interval stored with
+    // multiplicity k is written k times, the visitor gets f(begin, end, multip) once.
+    template <class OutputIt>
+    OutputIt query(const P &p, OutputIt out) const { return write_intervals(p, p, true, out); }
+    template <class F>
+    void visit(const P &p, F f) const {
+        tree_stats.add(STAT_QUERIES);
+        node_visit(root, p, p, true, f);
+    }
+
+    template <class OutputIt>
+    OutputIt query_overlap(const P &begin, const P &end, OutputIt out) const { return write_intervals(begin, end, false, out); }
+    template <class F>
+    void visit_overlap(const P &begin, const P &end, F f) const {
+        tree_stats.add(STAT_QUERIES);
+        node_visit(root, begin, end, false, f);
+    }
+    size_t count_overlap(const P &begin, const P &end) const {
+        tree_stats.add(STAT_QUERIES);
+        size_t count = 0;
+        auto f = [&count](const P &, const P &, const size_t multip) { count += multip; };
+        node_visit(root, begin, end, false, f);
+        return count;
+    }
+
+    // Every interval in key order, f(begin, end, multip).
+    template <class F>
+    void visit_all(F f) const { node_visit_all(root, f); }
+
+    // Counters of the operations so far (only with PIT_STATS defined), and the shape of the tree.
+    TreeStatsSnapshot stats() const {
+        TreeStatsSnapshot snapshot;
+        tree_stats.collect(snapshot);
+        node_shape(root, 1, snapshot);
+        return snapshot;
+    }
+    void reset_stats() { tree_stats.reset(); }
 
     // 1D print
     void print() {
@@ -118,13 +440,26 @@ public:
     }
 
     ~IntervalTree() {
-        if (root != nullptr) {
-            delete root; 
-        }
+        node_free_all(root);
     }
 
 private:
 
+    void node_free(Node *node) {
+        free_subtree(alloc, node, [](Node *) {});
+    }
+
+    void node_free_all(Node *node) {
+        if constexpr (Alloc::releases_in_bulk) {
+            if (!std::is_trivially_destructible<P>::value) {
+                node_free(node);
+            }
+            alloc.release();
+        } else {
+            node_free(node);
+        }
+    }
+
     int node_height(Node *node) {
         if (node->left && node->right) {
             return max(node->left->height, node->right->height) + 1;
@@ -147,145 +482,327 @@ private:
             return 0;
         }
     }
-    P &node_max(Node *node) {
-        if (node->left && node->right) {
-            return max(node->end, max(node->left->max, node->right->max));
-        } else if (node->left) {
-            return max(node->end, node->left->max);
-        } else if (node->right) {
-            return max(node->end, node->right->max);
-        } else {
-            return node->end;
-        }
+    // Recomputes max and low from the end and the children, in place. Returns whether either changed.
+    bool node_update_max(Node *node) {
+        const bool low = assign_low(node->low, node->end, node->left ? &node->left->low : nullptr, node->right ? &node->right->low : nullptr);
+        return assign_max(node->max, node->end, node->left ? &node->left->max : nullptr, node->right ? &node->right->max : nullptr) || low;
     }
 
-    Node *node_insert(Node *node, const P &begin, const P &end) {
-        return node_insert(node, begin, end, 1);
-    }
-    Node *node_insert(Node *node, const P &begin, const P &end, const size_t multip) {
-        if (node == nullptr) {
-            return new Node(begin, end);
-        } else if (begin <= node->begin) {
-            if (begin==node->begin && end==node->end) {
-                node->multip += multip;
-                return node;
+    // Path of an update, each node with the side the descent took.
+    struct Step {
+        Node *node;
+        bool left;
+    };
+    typedef TraversalStack<Step> Path;
+
+    // B and E are const P& or P, the new node copies or takes over the endpoints.
+    template <class B, class E>
+    Node *node_insert(Node *root, B &&begin, E &&end, const size_t multip) {
+        Path path;
+        Node *node = root;
+        while (node != nullptr) {
+            if (!interval_less(node->begin, node->end, begin, end)) {
+                if (begin==node->begin && end==node->end) {
+                    node->multip += multip;
+                    return root;
+                }
+                path.push({node, true});
+                node = node->left;
+            } else {
+                path.push({node, false});
+                node = node->right;
             }
-            node->left = node_insert(node->left, begin, end);
-        } else {
-            node->right = node_insert(node->right, begin, end);
         }
-
-        node->height = node_height(node);
-        node->max = node_max(node);
-        //std::cout << node->begin[0] << " " << node->height << " --- ";
-
-        if      (node_bf(node)== 2 && node_bf(node->left)==  1) { node = node_llrotation(node); }
-        else if (node_bf(node)==-2 && node_bf(node->right)==-1) { node = node_rrrotation(node); }
-        else if (node_bf(node)==-2 && node_bf(node->right)== 1) { node = node_rlrotation(node); }
-        else if (node_bf(node)== 2 && node_bf(node->left)== -1) { node = node_lrrotation(node); }
-
-        //std::cout << node->begin[0] << " " << node->height << std::endl;
-
-        return node;
-
+        Node *created = alloc.template create<Node>(std::forward<B>(begin), std::forward<E>(end));
+        created->multip = multip;
+        return node_fix_path(path, created, root, 0);
     }
 
     Node *node_remove(Node *node, const P &begin, const P &end) {
         return node_remove(node, begin, end, 1);
     }
-    Node *node_remove(Node *node, const P &begin, const P &end, const size_t multip) {
-        if (node == nullptr) {
-            return nullptr;
+    // A node with children is not unlinked: it takes over the interval of its in-order neighbour,
+    // whose removal continues down the same path.
+    Node *node_remove(Node *root, const P &begin, const P &end, const size_t multip) {
+        Path path;
+        Node *node = root;
+        // The interval looked for, the endpoints of the node that took it over once a neighbour moves up.
+        const P *b = &begin, *e = &end;
+        size_t m = multip;
+        // Depth of the first node that took over an interval, its max has to be recomputed.
+        size_t copied = SIZE_MAX;
+        while (node != nullptr) {
+            if (!interval_less(node->begin, node->end, *b, *e)) {
+                if (*b==node->begin && *e==node->end) {
+                    if (node->multip > m) {
+                        node->multip -= m;
+                        return root;
+                    }
+                    copied = std::min(copied, path.size());
+                    if (node->left != nullptr) {
+                        Node *up = node_rightmost(node->left);
+                        node->begin = up->begin;
+                        node->end = up->end;
+                        node->multip = m = up->multip;
+                        b = &node->begin;
+                        e = &node->end;
+                        path.push({node, true});
+                        node = node->left;
+                    } else if (node->right != nullptr) {
+                        Node *up = node_leftmost(node->right);
+                        node->begin = up->begin;
+                        node->end = up->end;
+                        node->multip = m = up->multip;
+                        b = &node->begin;
+                        e = &node->end;
+                        path.push({node, false});
+                        node = node->right;
+                    } else {
+                        alloc.destroy(node);
+                        return node_fix_path(path, nullptr, root, copied);
+                    }
+                } else {
+                    path.push({node, true});
+                    node = node->left;
+                }
+            } else {
+                path.push({node, false});
+                node = node->right;
+            }
         }
+        return root;
+    }
 
-        if (begin <= node->begin) {
-            if (begin==node->begin && end==node->end) {
-                if (node->multip > multip) {
-                    node->multip -= multip;
-                    return node;
+    // What is left of the children is joined back around the node if it stays, so the tree is rebalanced
+    // on the way up: a join only goes down the taller side as far as the heights differ.
+    Node *node_prune(Node *node, const P &watermark, size_t &pruned) {
+        // A node waits on the stack while its children are pruned, with what is left of its left subtree.
+        struct Frame {
+            Node *node;
+            Node *left;
+            bool right;
+        };
+        TraversalStack<Frame> stack;
+        while (true) {
+            while (node != nullptr && node->low < watermark[0] && !all_less(node->max, watermark)) {
+                stack.push({node, nullptr, false});
+                node = node->left;
+            }
+            // A subtree with nothing expired stays as it is, one expired as a whole goes at once.
+            Node *rest = node;
+            if (node != nullptr && node->low < watermark[0]) {
+                free_subtree(alloc, node, [&pruned](Node *n) { pruned += n->multip; });
+                rest = nullptr;
+            }
+            while (true) {
+                if (stack.empty()) return rest;
+                Frame &top = stack.top();
+                if (!top.right) {
+                    top.left = rest;
+                    top.right = true;
+                    node = top.node->right;
+                    break;
                 }
-                if (node->left != nullptr) {
-                    Node *up = node_rightmost(node->left);
-                    node->begin = up->begin;
-                    node->end = up->end;
-                    node->multip = up->multip;
-                    node->left = node_remove(node->left, up->begin, up->end, up->multip);
-                } else if (node->right != nullptr) {
-                    Node *up = node_leftmost(node->right);
-                    node->begin = up->begin;
-                    node->end = up->end;
-                    node->multip = up->multip;
-                    node->right = node_remove(node->right, up->begin, up->end, up->multip);
-                } else {
-                    delete node;
-                    return nullptr;
+                const Frame frame = stack.pop();
+                if (all_less(frame.node->end, watermark)) {
+                    pruned += frame.node->multip;
+                    alloc.destroy(frame.node);
+                    rest = node_join(frame.left, rest);
+                }
+                else {
+                    rest = node_join(frame.left, frame.node, rest);
                 }
-            } else {
-                node->left = node_remove(node->left, begin, end);
             }
-        } else {
-            node->right = node_remove(node->right, begin, end);
         }
+    }
 
-        node->height = node_height(node);
-        node->max = node_max(node);
-        //std::cout << node->begin[0] << " " << node->height << " "  << node->max[0] <<  " --- ";
+    static int node_height_of(const Node *node) { return node ? node->height : 0; }
+
+    // Links left and right below node, in key order. Their heights may differ by any amount, the shorter one
+    // is joined into the spine of the taller one, where the heights meet.
+    Node *node_join(Node *left, Node *node, Node *right) {
+        const int left_height = node_height_of(left);
+        const int right_height = node_height_of(right);
+        Path path;
+        Node *top = nullptr;
+        if (left_height > right_height + 1) {
+            top = left;
+            for (; node_height_of(left) > right_height + 1; left = left->right) path.push({left, false});
+        }
+        else if (right_height > left_height + 1) {
+            top = right;
+            for (; node_height_of(right) > left_height + 1; right = right->left) path.push({right, true});
+        }
+        node->left = left;
+        node->right = right;
+        bool changed;
+        return node_fix_path(path, node_balance(node, changed), top, SIZE_MAX);
+    }
 
+    // Same without a node in between, the leftmost node of right takes that place.
+    Node *node_join(Node *left, Node *right) {
+        if (left == nullptr) return right;
+        if (right == nullptr) return left;
+        Node *first;
+        right = node_split_first(right, first);
+        return node_join(left, first, right);
+    }
 
-        if      (node_bf(node)== 2 && node_bf(node->left)==  1) { node = node_llrotation(node); }                  
-        else if (node_bf(node)== 2 && node_bf(node->left)==- 1) { node = node_lrrotation(node); }
-        else if (node_bf(node)== 2 && node_bf(node->left)==  0) { node = node_llrotation(node); }
-        else if (node_bf(node)==-2 && node_bf(node->right)==-1) { node = node_rrrotation(node); }
-        else if (node_bf(node)==-2 && node_bf(node->right)== 1) { node = node_rlrotation(node); }
-        else if (node_bf(node)==-2 && node_bf(node->right)== 0) { node = node_llrotation(node); }
+    // Unlinks the leftmost node of the subtree into first, returns the rest rebalanced.
+    Node *node_split_first(Node *node, Node *&first) {
+        Path path;
+        for (first = node; first->left != nullptr; first = first->left) path.push({first, true});
+        return node_fix_path(path, first->right, node, SIZE_MAX);
+    }
 
-        //std::cout << node->begin[0] << " " << node->height << std::endl;
+    // Links sub in place of the child at the end of the path, then walks back up: heights and maxes
+    // are recomputed and the nodes rotated where the balance broke. Returns the new root.
+    // Once a node keeps its child, height and max the nodes above are unchanged too, the walk stops
+    // there unless it has yet to reach depth `copied`.
+    Node *node_fix_path(Path &path, Node *sub, Node *root, const size_t copied) {
+        while (!path.empty()) {
+            const Step step = path.pop();
+            Node *node = step.node;
+            Node *&child = step.left ? node->left : node->right;
+            const bool relinked = child != sub;
+            child = sub;
+            bool changed;
+            sub = node_balance(node, changed);
+            if (!relinked && !changed && path.size() <= copied) return root;
+        }
+        return sub;
+    }
 
-        return node;
+    // changed is false if node kept its height and max, and needed no rotation.
+    Node *node_balance(Node *node, bool &changed) {
+        const int height = node_height(node);
+        changed = node_update_max(node) || height != node->height;
+        node->height = height;
+
+        Node *top = node;
+        if      (node_bf(node)== 2 && node_bf(node->left)==  1) { top = node_llrotation(node); }
+        else if (node_bf(node)== 2 && node_bf(node->left)==- 1) { top = node_lrrotation(node); }
+        else if (node_bf(node)== 2 && node_bf(node->left)==  0) { top = node_llrotation(node); }
+        else if (node_bf(node)==-2 && node_bf(node->right)==-1) { top = node_rrrotation(node); }
+        else if (node_bf(node)==-2 && node_bf(node->right)== 1) { top = node_rlrotation(node); }
+        else if (node_bf(node)==-2 && node_bf(node->right)== 0) { top = node_rrrotation(node); }
+        if (top != node) changed = true;
+
+        return top;
     }
 
+    // Goes down the left links, the stack holds the right subtrees still to count.
     size_t node_query(const Node *node, const P &p) const {
-        if (node == nullptr) {
-            return 0;
+        size_t count = 0;
+        TraversalStack<const Node*> stack;
+        while (true) {
+            for (; node != nullptr; node = node->left) {
+                tree_stats.add(STAT_VISITED);
+                if (!all_less(p, node->max)) break;
+                if (!(p[0] < node->begin[0])) {
+                    if (node->right) stack.push(node->right);
+                    if (box_overlaps(node->begin, node->end, p, p, true)) count += node->multip;
+                }
+            }
+            if (stack.empty()) return count;
+            node = stack.pop();
         }
-        //std::cout << node->begin[0] << ' ' << node->end[0] << ' ' << p[0] << std::endl;
-        if (p < node->begin) {
-            return node_query(node->left, p);
-        } else if (p < node->max) {
-            size_t subquery = node_query(node->left, p) + node_query(node->right, p);
-            if (p < node->end) return subquery + node->multip;
-            else return subquery;
-        } else {
-            return 0;
+    }
+
+    template <class OutputIt>
+    OutputIt write_intervals(const P &a, const P &b, const bool closed, OutputIt out) const {
+        auto f = [&out](const P &begin, const P &end, const size_t multip) {
+            for (size_t i = 0; i < multip; ++i) *out++ = I(begin, end);
+        };
+        tree_stats.add(STAT_QUERIES);
+        node_visit(root, a, b, closed, f);
+        return out;
+    }
+
+    // Visits the intervals overlapping [a,b), or [a,b] when closed (a==b is a stabbing query).
+    // Subtrees whose max is not above a cannot overlap, right subtrees start after the node's begin[0].
+    // In key order: the stack holds the nodes whose left subtree is being walked.
+    template <class F>
+    void node_visit(const Node *node, const P &a, const P &b, const bool closed, F &f) const {
+        TraversalStack<const Node*> stack;
+        while (true) {
+            for (; node != nullptr; node = node->left) {
+                tree_stats.add(STAT_VISITED);
+                if (!all_less(a, node->max)) break;
+                stack.push(node);
+            }
+            if (stack.empty()) return;
+            node = stack.pop();
+            if (closed ? !(b[0] < node->begin[0]) : node->begin[0] < b[0]) {
+                if (box_overlaps(node->begin, node->end, a, b, closed)) f(node->begin, node->end, node->multip);
+                node = node->right;
+            } else {
+                node = nullptr;
+            }
+        }
+    }
+
+    template <class F>
+    void node_visit_all(const Node *node, F &f) const {
+        TraversalStack<const Node*> stack;
+        while (true) {
+            for (; node != nullptr; node = node->left) stack.push(node);
+            if (stack.empty()) return;
+            node = stack.pop();
+            f(node->begin, node->end, node->multip);
+            node = node->right;
+        }
+    }
+
+    void node_shape(const Node *root, const size_t depth, TreeStatsSnapshot &snapshot) const {
+        struct Level {
+            const Node *node;
+            size_t depth;
+        };
+        TraversalStack<Level> stack;
+        stack.push({root, depth});
+        while (!stack.empty()) {
+            const Level top = stack.pop();
+            if (top.node == nullptr) {
+                ++snapshot.null_nodes;
+                continue;
+            }
+            ++snapshot.nodes;
+            snapshot.height = std::max(snapshot.height, top.depth);
+            stack.push({top.node->left, top.depth + 1});
+            stack.push({top.node->right, top.depth + 1});
         }
     }
 
     Node *node_llrotation(Node *node) {
         //std::cout << "LL";
+        tree_stats.add(STAT_ROTATIONS_LL);
         Node *p = node, *tp = p->left;
         p->left = tp->right;
         tp->right = p;
         // update
         p->height = node_height(p);
         tp->height = node_height(tp);
-        p->max = node_max(p);
-        tp->max = node_max(tp);
+        node_update_max(p);
+        node_update_max(tp);
         return tp;
     }
     Node *node_rrrotation(Node *node) {
         //std::cout << "RR";
+        tree_stats.add(STAT_ROTATIONS_RR);
         Node *p = node, *tp = p->right;
         p->right = tp->left;
         tp->left = p;
         // update
         p->height = node_height(p);
         tp->height = node_height(tp);
-        p->max = node_max(p);
-        tp->max = node_max(tp);
+        node_update_max(p);
+        node_update_max(tp);
         return tp;
     }
     Node *node_rlrotation(Node *node) {
         //std::cout << "RL";
+        tree_stats.add(STAT_ROTATIONS_RL);
         Node *p = node, *tp = p->right, *tp2 = p->right->left;
         p->right = tp2->left;
         tp->left = tp2->right;
@@ -295,13 +812,14 @@ private:
         p->height = node_height(p);
         tp->height = node_height(tp);
         tp2->height = node_height(tp2);
-        p->max = node_max(p);
-        tp->max = node_max(tp);
-        tp2->max = node_max(tp2);
+        node_update_max(p);
+        node_update_max(tp);
+        node_update_max(tp2);
         return tp2;
     }
     Node *node_lrrotation(Node *node) {
         //std::cout << "LR";
+        tree_stats.add(STAT_ROTATIONS_LR);
         Node *p = node, *tp = p->left, *tp2 = p->left->right;
         p->left = tp2->right;
         tp->right = tp2->left;
@@ -311,12 +829,24 @@ private:
         p->height = node_height(p);
         tp->height = node_height(tp);
         tp2->height = node_height(tp2);
-        p->max = node_max(p);
-        tp->max = node_max(tp);
-        tp2->max = node_max(tp2);
+        node_update_max(p);
+        node_update_max(tp);
+        node_update_max(tp2);
         return tp2;
     }
 
+    Node *node_build(const std::vector<I> &intervals, const std::vector<size_t> &multips, const size_t lo, const size_t hi) {
+        if (lo == hi) return nullptr;
+        const size_t mid = lo + (hi - lo) / 2;
+        Node *left = node_build(intervals, multips, lo, mid);
+        Node *right = node_build(intervals, multips, mid + 1, hi);
+        Node *node = alloc.template create<Node>(intervals[mid], left, right);
+        node->multip = multips[mid];
+        node->height = node_height(node);
+        node_update_max(node);
+        return node;
+    }
+
     Node *node_leftmost(Node* node) {
         while (node->left != nullptr)
             node = node->left;
@@ -331,5 +861,11 @@ private:
 private:
     size_t dim;
     Node *root = nullptr;
+    Alloc alloc;
+#ifdef PIT_STATS
+    TreeStats tree_stats;
+#else
+    static constexpr TreeStats tree_stats{};
+#endif
 };
 
@@ -1,7 +1,13 @@
 #include <iostream>
 #include "it.hpp"
 #include "pit.hpp"
+#include "snapshot.hpp"
+#include <cstdio>
+#include <fstream>
 #include <set>
+#include <iterator>
+#include <random>
+#include <vector>
 
 using namespace std;
 
@@ -35,5 +41,70 @@ int main() {
         cout << i << ' ' << t.query(i) << ' ' << pt.query(i) << endl;
     }
 
+    vector<Interval<int>> overlapping;
+    pt.query_overlap(10, 15, back_inserter(overlapping));
+    cout << "[10,15): " << t.count_overlap(10, 15) << ' ' << pt.count_overlap(10, 15) << ' ';
+    for (auto &iv : overlapping) cout << iv.begin[0] << '-' << iv.end[0] << ' ';
+    cout << endl;
+
+    // apply_batch against the same tasks applied one at a time, in order
+    auto task = [](const TaskMethods::methods method, const int a, const int b) {
+        Task<int> task;
+        task.method = method;
+        task.a = a;
+        task.b = b;
+        return task;
+    };
+    const auto Q = TaskMethods::QUERY, I = TaskMethods::INSERT, R = TaskMethods::REMOVE;
+    vector<vector<Task<int>>> batches = {
+        {task(R, 0, 3), task(I, 0, 3)},
+        {task(Q, 0, 3), task(R, 0, 3), task(R, 3, 5), task(I, 0, 2), task(R, 3, 4), task(Q, 0, 3),
+         task(I, 2, 5), task(Q, 4, 5), task(I, 1, 5), task(R, 1, 5), task(R, 0, 5), task(I, 0, 3)},
+        {task(R, 0, 3), task(R, 0, 3), task(I, 0, 3), task(I, 0, 3)},
+    };
+    mt19937 gen(1);
+    for (int k = 0; k < 200; ++k) {
+        vector<Task<int>> batch;
+        for (int j = 0; j < 12; ++j) {
+            const int a = gen() % 5;
+            batch.push_back(task(static_cast<TaskMethods::methods>(gen() % 3), a, a + 1 + gen() % 3));
+        }
+        batches.push_back(batch);
+    }
+    ParallelIntervalTree<int> batched, ordered;
+    size_t mismatches = 0;
+    for (const auto &batch : batches) {
+        const vector<size_t> results = batched.apply_batch(batch.begin(), batch.end());
+        for (const auto &tk : batch) {
+            if (tk.method == TaskMethods::INSERT) ordered.insert(tk.a, tk.b);
+            else if (tk.method == TaskMethods::REMOVE) ordered.remove(tk.a, tk.b);
+        }
+        // The queries of a batch see all of its updates
+        for (size_t j = 0; j < batch.size(); ++j) {
+            if (batch[j].method == TaskMethods::QUERY && results[j] != ordered.query(batch[j].a)) ++mismatches;
+        }
+        for (int p = 0; p < 8; ++p) {
+            if (batched.query(p) != ordered.query(p)) ++mismatches;
+        }
+    }
+    cout << "apply_batch: " << batches.size() << " batches, " << mismatches << " mismatches" << endl;
+
+    // A snapshot opens, a truncated one or one with a huge count in the header doesn't
+    const char *path = "main_snapshot.bin";
+    save_snapshot(pt, path);
+    ifstream in(path, ios::binary);
+    const vector<char> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    auto open_as = [&](vector<char> copy) {
+        ofstream(path, ios::binary | ios::trunc).write(copy.data(), copy.size());
+        MappedIntervalTree<ParallelIntervalTree<int>> mapped;
+        return mapped.open_mapped(path) && mapped.query(9) == pt.query(9);
+    };
+    vector<char> huge = bytes;
+    const uint64_t count = uint64_t(1) << 62;
+    memcpy(huge.data() + offsetof(SnapshotHeader, count), &count, sizeof(count));
+    cout << "snapshot: " << open_as(bytes) << ' ' << open_as(vector<char>(bytes.begin(), bytes.end() - 64)) << ' '
+         << open_as(huge) << endl;
+    remove(path);
+
 }
 
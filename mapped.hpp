@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Shared by the binary file formats, traces (trace.hpp) and snapshots (snapshot.hpp).
+
+
+// Tag of the value type stored in a file, a file is only read back with the type it was written with:
+// 0 signed integer, 1 unsigned integer, 2 floating point, next to its size.
+template <typename T>
+constexpr uint32_t value_kind() {
+    return std::is_floating_point<T>::value ? 2 : (std::is_signed<T>::value ? 0 : 1);
+}
+
+
+// A whole file mapped read-only. Pages are read in on first touch, so opening costs the same
+// whatever the size of the file.
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    // Returns false if the file can't be opened or is empty.
+    bool open(const std::string &path) {
+        close();
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void *mapped = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        bytes = static_cast<const char*>(mapped);
+        length = st.st_size;
+        return true;
+    }
+
+    void close() {
+        if (bytes) ::munmap(const_cast<char*>(bytes), length);
+        bytes = nullptr;
+        length = 0;
+    }
+
+    // Access pattern hint, MADV_SEQUENTIAL or MADV_RANDOM.
+    void advise(const int advice) const {
+        if (bytes) ::madvise(const_cast<char*>(bytes), length, advice);
+    }
+
+    const char *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char *bytes = nullptr;
+    size_t length = 0;
+};
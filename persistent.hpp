@@ -0,0 +1,418 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "it.hpp"
+#include "ebr.hpp"
+
+
+// Nodes never change once built, an update copies the path to the nodes it touches and shares the rest.
+// Every version holding a node, as a child or as a root, holds a reference to it.
+template <class Interval, typename T = typename Interval::value_t>
+class PersistentIntervalTreeNode {
+public:
+    typedef T value_t;
+    typedef typename Interval::P P;
+    typedef Interval I;
+    PersistentIntervalTreeNode(const P &begin, const P &end, const size_t multip, const PersistentIntervalTreeNode *left, const PersistentIntervalTreeNode *right)
+        : begin(begin), end(end), max(end), multip(multip), size(multip), height(1), refs(1), left(left), right(right) {
+        for (const PersistentIntervalTreeNode *child : {left, right}) {
+            if (child) {
+                extend_max(max, child->max);
+                size += child->size;
+                height = std::max(height, child->height + 1);
+            }
+        }
+    }
+public:
+    const P begin;
+    const P end;
+    P max;
+    const size_t multip;
+    // Sum of multip values in the subtree
+    size_t size;
+    int height;
+    mutable std::atomic<size_t> refs;
+    const PersistentIntervalTreeNode *left, *right;
+};
+
+
+// Multi-version interval tree: an AVL tree built by path copying. Writers are serialized, each update
+// builds a new version next to the current one and publishes its root at once, readers never lock and
+// never see a half done update. snapshot() pins the current version in O(1), it stays readable however
+// the tree changes afterwards. Replaced roots are released through an epoch domain, so a reader that
+// loaded the root just before it was replaced can still take its reference; versions no snapshot holds
+// anymore are freed node by node by their last reference.
+// Snapshots must not outlive the tree, its allocator frees their nodes.
+template <typename T, size_t D = DYNAMIC_DIM, class Alloc = HeapAllocator>
+class PersistentIntervalTree {
+public:
+    typedef T value_t;
+    typedef Point<T, D> P;
+    typedef Interval<T, D> I;
+    typedef PersistentIntervalTreeNode<I> Node;
+
+    // One version of the tree, read without locks.
+    class Snapshot {
+    public:
+        Snapshot() : tree(nullptr), root(nullptr) {}
+        Snapshot(const Snapshot &other) : tree(other.tree), root(acquire(other.root)) {}
+        Snapshot(Snapshot &&other) noexcept : tree(other.tree), root(other.root) { other.root = nullptr; }
+        Snapshot& operator=(Snapshot other) {
+            std::swap(tree, other.tree);
+            std::swap(root, other.root);
+            return *this;
+        }
+        ~Snapshot() { if (root) tree->release(root); }
+
+        size_t query(const P &p) const { return node_query(root, p); }
+
+        // Intervals containing p, or overlapping [begin,end). An interval stored with
+        // multiplicity k is written k times, the visitor gets f(begin, end, multip) once.
+        template <class OutputIt>
+        OutputIt query(const P &p, OutputIt out) const { return write_intervals(root, p, p, true, out); }
+        template <class F>
+        void visit(const P &p, F f) const { node_visit(root, p, p, true, f); }
+
+        template <class OutputIt>
+        OutputIt query_overlap(const P &begin, const P &end, OutputIt out) const { return write_intervals(root, begin, end, false, out); }
+        template <class F>
+        void visit_overlap(const P &begin, const P &end, F f) const { node_visit(root, begin, end, false, f); }
+        size_t count_overlap(const P &begin, const P &end) const { return node_count(root, begin, end, false); }
+
+        // Every interval in key order, f(begin, end, multip).
+        template <class F>
+        void visit_all(F f) const { node_visit_all(root, f); }
+
+        // Number of intervals, duplicates included
+        size_t size() const { return root ? root->size : 0; }
+
+    private:
+        friend class PersistentIntervalTree;
+        Snapshot(const PersistentIntervalTree *tree, const Node *root) : tree(tree), root(root) {}
+
+        const PersistentIntervalTree *tree;
+        const Node *root;
+    };
+
+    PersistentIntervalTree(const size_t dim) : dim(dim), root(nullptr) {}
+    PersistentIntervalTree() : PersistentIntervalTree(1) {}
+    PersistentIntervalTree(const PersistentIntervalTree&) = delete;
+    PersistentIntervalTree& operator=(const PersistentIntervalTree&) = delete;
+
+    void insert(const I &interval) { insert(interval.begin, interval.end); }
+    void insert(const P &begin, const P &end) {
+        std::lock_guard<std::mutex> guard(writer);
+        publish(node_insert(current(), begin, end));
+    }
+
+    void remove(const I &interval) { remove(interval.begin, interval.end); }
+    void remove(const P &begin, const P &end) {
+        std::lock_guard<std::mutex> guard(writer);
+        const Node *node = current();
+        if (node_multip(node, begin, end) > 0) publish(node_remove(node, begin, end));
+    }
+
+    // Applies the tasks of [first, last) (see Task), returns the query results in task order, 0 for the others.
+    // The updates go into one new version, published once; the queries see every update of the batch.
+    template <class InputIt>
+    std::vector<size_t> apply_batch(InputIt first, InputIt last) {
+        std::vector<size_t> results(std::distance(first, last), 0);
+        Snapshot version;
+        {
+            std::lock_guard<std::mutex> guard(writer);
+            const Node *next = acquire(current());
+            for (InputIt it = first; it != last; ++it) {
+                const Node *updated = nullptr;
+                if (it->method == TaskMethods::INSERT) updated = node_insert(next, it->a, it->b);
+                else if (it->method == TaskMethods::REMOVE && node_multip(next, it->a, it->b) > 0) updated = node_remove(next, it->a, it->b);
+                else continue;
+                // The versions in between were never published, their copies are freed at once.
+                release(next);
+                next = updated;
+            }
+            version = Snapshot(this, acquire(next));
+            if (next != current()) publish(next);
+            else release(next);
+        }
+        size_t i = 0;
+        for (InputIt it = first; it != last; ++it, ++i) {
+            if (it->method == TaskMethods::QUERY) results[i] = version.query(it->a);
+        }
+        return results;
+    }
+
+    // Replaces the contents with the intervals of [first, last): sorted, duplicates collapsed,
+    // then built perfectly balanced in one pass and published at once.
+    template <class InputIt>
+    void build(InputIt first, InputIt last) {
+        std::vector<I> intervals(first, last);
+        const std::vector<size_t> multips = sort_collapse(intervals);
+        const Node *built = node_build(intervals, multips, 0, intervals.size());
+        std::lock_guard<std::mutex> guard(writer);
+        publish(built);
+    }
+
+    // Removes every interval, like building from an empty range.
+    void clear() {
+        const I *none = nullptr;
+        build(none, none);
+    }
+
+    // The current version, O(1).
+    Snapshot snapshot() const {
+        EpochDomain::Guard guard(epochs);
+        return Snapshot(this, acquire(root.load(std::memory_order_acquire)));
+    }
+
+    // Reads of the current version. They pin the epoch instead of taking a reference,
+    // the version they read stays allocated until they are done.
+    size_t query(const P &p) const {
+        EpochDomain::Guard guard(epochs);
+        return node_query(root.load(std::memory_order_acquire), p);
+    }
+
+    template <class OutputIt>
+    OutputIt query(const P &p, OutputIt out) const { return snapshot().query(p, out); }
+    template <class F>
+    void visit(const P &p, F f) const { snapshot().visit(p, f); }
+
+    template <class OutputIt>
+    OutputIt query_overlap(const P &begin, const P &end, OutputIt out) const { return snapshot().query_overlap(begin, end, out); }
+    template <class F>
+    void visit_overlap(const P &begin, const P &end, F f) const { snapshot().visit_overlap(begin, end, f); }
+    size_t count_overlap(const P &begin, const P &end) const {
+        EpochDomain::Guard guard(epochs);
+        return node_count(root.load(std::memory_order_acquire), begin, end, false);
+    }
+
+    // Every interval in key order, f(begin, end, multip), from the current version.
+    template <class F>
+    void visit_all(F f) const { snapshot().visit_all(f); }
+
+    size_t size() const {
+        EpochDomain::Guard guard(epochs);
+        const Node *node = root.load(std::memory_order_acquire);
+        return node ? node->size : 0;
+    }
+
+    ~PersistentIntervalTree() {
+        release(root.load(std::memory_order_relaxed));
+        // Replaced roots still in limbo are released by the epoch domain, before the allocator is destroyed.
+    }
+
+    // Reclamation counters: roots replaced so far, and how many of them are already released.
+    size_t retired_versions() const { return epochs.retired(); }
+    size_t released_versions() const { return epochs.reclaimed(); }
+
+private:
+    // The current root, only written under the writer lock.
+    const Node *current() const { return root.load(std::memory_order_relaxed); }
+
+    // Makes next the current version, the reference of the tree moves to it. Writer lock must be held.
+    void publish(const Node *next) {
+        const Node *old = root.exchange(next, std::memory_order_acq_rel);
+        if (old) epochs.retire(const_cast<Node*>(old), release_root, this);
+    }
+
+    static void release_root(void *node, void *tree) {
+        static_cast<PersistentIntervalTree*>(tree)->release(static_cast<const Node*>(node));
+    }
+
+    static const Node *acquire(const Node *node) {
+        if (node) node->refs.fetch_add(1, std::memory_order_relaxed);
+        return node;
+    }
+
+    // Drops a reference, the last one frees the node and drops those of its children.
+    void release(const Node *node) const {
+        TraversalStack<const Node*> stack;
+        stack.push(node);
+        while (!stack.empty()) {
+            node = stack.pop();
+            if (node && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                stack.push(node->left);
+                stack.push(node->right);
+                alloc.destroy(const_cast<Node*>(node));
+            }
+        }
+    }
+
+    static int height(const Node *node) { return node ? node->height : 0; }
+
+    // The new nodes take over the references to left and right.
+    const Node *node_make(const P &begin, const P &end, const size_t multip, const Node *left, const Node *right) {
+        return alloc.template create<Node>(begin, end, multip, left, right);
+    }
+
+    // node_make with the AVL rotations the subtrees need, their heights differ by at most 2.
+    // left and right may be new copies, a rotation replaces the one it takes apart.
+    const Node *node_balance(const P &begin, const P &end, const size_t multip, const Node *left, const Node *right) {
+        if (height(left) > height(right) + 1) {
+            const Node *node;
+            if (height(left->left) >= height(left->right)) {
+                // LL
+                node = node_make(left->begin, left->end, left->multip, acquire(left->left),
+                    node_make(begin, end, multip, acquire(left->right), right));
+            }
+            else {
+                // LR
+                const Node *inner = left->right;
+                node = node_make(inner->begin, inner->end, inner->multip,
+                    node_make(left->begin, left->end, left->multip, acquire(left->left), acquire(inner->left)),
+                    node_make(begin, end, multip, acquire(inner->right), right));
+            }
+            release(left);
+            return node;
+        }
+        if (height(right) > height(left) + 1) {
+            const Node *node;
+            if (height(right->right) >= height(right->left)) {
+                // RR
+                node = node_make(right->begin, right->end, right->multip,
+                    node_make(begin, end, multip, left, acquire(right->left)), acquire(right->right));
+            }
+            else {
+                // RL
+                const Node *inner = right->left;
+                node = node_make(inner->begin, inner->end, inner->multip,
+                    node_make(begin, end, multip, left, acquire(inner->left)),
+                    node_make(right->begin, right->end, right->multip, acquire(inner->right), acquire(right->right)));
+            }
+            release(right);
+            return node;
+        }
+        return node_make(begin, end, multip, left, right);
+    }
+
+    // The updates return the root of the new version of the subtree, node itself is only read.
+    const Node *node_insert(const Node *node, const P &begin, const P &end) {
+        if (node == nullptr) {
+            return node_make(begin, end, 1, nullptr, nullptr);
+        } else if (begin==node->begin && end==node->end) {
+            return node_make(node->begin, node->end, node->multip + 1, acquire(node->left), acquire(node->right));
+        } else if (interval_less(begin, end, node->begin, node->end)) {
+            return node_balance(node->begin, node->end, node->multip, node_insert(node->left, begin, end), acquire(node->right));
+        } else {
+            return node_balance(node->begin, node->end, node->multip, acquire(node->left), node_insert(node->right, begin, end));
+        }
+    }
+
+    // The interval must be stored in the subtree of node.
+    const Node *node_remove(const Node *node, const P &begin, const P &end) {
+        if (begin==node->begin && end==node->end) {
+            if (node->multip > 1) {
+                return node_make(node->begin, node->end, node->multip - 1, acquire(node->left), acquire(node->right));
+            } else if (node->left == nullptr) {
+                return acquire(node->right);
+            } else if (node->right == nullptr) {
+                return acquire(node->left);
+            }
+            // The successor takes the place of node.
+            const Node *next = node->right;
+            while (next->left != nullptr) next = next->left;
+            return node_balance(next->begin, next->end, next->multip, acquire(node->left), node_remove_leftmost(node->right));
+        } else if (interval_less(begin, end, node->begin, node->end)) {
+            return node_balance(node->begin, node->end, node->multip, node_remove(node->left, begin, end), acquire(node->right));
+        } else {
+            return node_balance(node->begin, node->end, node->multip, acquire(node->left), node_remove(node->right, begin, end));
+        }
+    }
+
+    const Node *node_remove_leftmost(const Node *node) {
+        if (node->left == nullptr) {
+            return acquire(node->right);
+        }
+        return node_balance(node->begin, node->end, node->multip, node_remove_leftmost(node->left), acquire(node->right));
+    }
+
+    const Node *node_build(const std::vector<I> &intervals, const std::vector<size_t> &multips, const size_t lo, const size_t hi) {
+        if (lo == hi) return nullptr;
+        const size_t mid = lo + (hi - lo) / 2;
+        const Node *left = node_build(intervals, multips, lo, mid);
+        const Node *right = node_build(intervals, multips, mid + 1, hi);
+        return node_make(intervals[mid].begin, intervals[mid].end, multips[mid], left, right);
+    }
+
+    static size_t node_multip(const Node *node, const P &begin, const P &end) {
+        while (node != nullptr) {
+            if (begin==node->begin && end==node->end) return node->multip;
+            node = interval_less(begin, end, node->begin, node->end) ? node->left : node->right;
+        }
+        return 0;
+    }
+
+    static size_t node_query(const Node *node, const P &p) {
+        size_t count = 0;
+        TraversalStack<const Node*> stack;
+        while (true) {
+            for (; node != nullptr && all_less(p, node->max); node = node->left) {
+                if (!(p[0] < node->begin[0])) {
+                    if (node->right) stack.push(node->right);
+                    if (box_overlaps(node->begin, node->end, p, p, true)) count += node->multip;
+                }
+            }
+            if (stack.empty()) return count;
+            node = stack.pop();
+        }
+    }
+
+    static size_t node_count(const Node *node, const P &a, const P &b, const bool closed) {
+        size_t count = 0;
+        auto f = [&count](const P &, const P &, const size_t multip) { count += multip; };
+        node_visit(node, a, b, closed, f);
+        return count;
+    }
+
+    template <class OutputIt>
+    static OutputIt write_intervals(const Node *node, const P &a, const P &b, const bool closed, OutputIt out) {
+        auto f = [&out](const P &begin, const P &end, const size_t multip) {
+            for (size_t i = 0; i < multip; ++i) *out++ = I(begin, end);
+        };
+        node_visit(node, a, b, closed, f);
+        return out;
+    }
+
+    // Visits the intervals overlapping [a,b), or [a,b] when closed, with the pruning of IntervalTree::node_visit.
+    template <class F>
+    static void node_visit(const Node *node, const P &a, const P &b, const bool closed, F &f) {
+        TraversalStack<const Node*> stack;
+        while (true) {
+            for (; node != nullptr && all_less(a, node->max); node = node->left) stack.push(node);
+            if (stack.empty()) return;
+            node = stack.pop();
+            if (closed ? !(b[0] < node->begin[0]) : node->begin[0] < b[0]) {
+                if (box_overlaps(node->begin, node->end, a, b, closed)) f(node->begin, node->end, node->multip);
+                node = node->right;
+            } else {
+                node = nullptr;
+            }
+        }
+    }
+
+    template <class F>
+    static void node_visit_all(const Node *node, F &f) {
+        TraversalStack<const Node*> stack;
+        while (true) {
+            for (; node != nullptr; node = node->left) stack.push(node);
+            if (stack.empty()) return;
+            node = stack.pop();
+            f(node->begin, node->end, node->multip);
+            node = node->right;
+        }
+    }
+
+private:
+    size_t dim;
+    std::mutex writer;
+    std::atomic<const Node*> root;
+    // Nodes are freed by whoever drops their last reference, snapshots on reader threads included.
+    mutable Alloc alloc;
+    // Replaced roots wait here for the readers that may have loaded them.
+    mutable EpochDomain epochs;
+};
@@ -5,31 +5,83 @@
 #include <array>
 #include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <utility>
 #include <vector>
 #include <mutex>
 #include <shared_mutex>
 #include <atomic>
+#include <future>
+#include <thread>
+#include <type_traits>
 #include "it.hpp"
+#include "ebr.hpp"
 
 
 namespace {
+    // Read-write lock with a seqlock style version, so readers can also go without locking:
+    // a writer holding the lock calls begin_write before changing the guarded data, which makes
+    // the version odd until unlock. An optimistic reader takes read_begin, reads the data and
+    // accepts it only if read_validate confirms the version is unchanged.
     class ReadWriteLock {
     public:
         using mutex_t = std::shared_mutex;
         using read_lock = std::shared_lock<mutex_t>;
         using write_lock = std::unique_lock<mutex_t>;
+        using version_t = uint64_t;
     private:
         mutable mutex_t mtx;
+        mutable std::atomic<version_t> version{0};
     public:
         read_lock scoped_lock_read() const { return read_lock(mtx); }
         write_lock scoped_lock_write() const { return write_lock(mtx); }
 
-        void lock_read() const { mtx.lock_shared(); }
+        void lock_read() const { stats_lock([this] { return mtx.try_lock_shared(); }, [this] { mtx.lock_shared(); }); }
         void unlock_read() const {mtx.unlock_shared(); }
 
-        void lock_write() const { mtx.lock(); }
-        void unlock_write() const { mtx.unlock(); }
+        void lock_write() const { stats_lock([this] { return mtx.try_lock(); }, [this] { mtx.lock(); }); }
+        void unlock_write() const { end_write(); mtx.unlock(); }
 
+        void begin_write() const {
+            version_t v = version.load(std::memory_order_relaxed);
+            if (v % 2 == 0) {
+                version.store(v + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+            }
+        }
+        void end_write() const {
+            version_t v = version.load(std::memory_order_relaxed);
+            if (v % 2 == 1) version.store(v + 1, std::memory_order_release);
+        }
+        // With the lock held: the data was unlinked by retire.
+        bool retired() const { return version.load(std::memory_order_relaxed) % 2 == 1; }
+        // Releases a write lock taken without writing, whatever the version is.
+        void unlock_unchanged() const { mtx.unlock(); }
+        // Releases the lock of unlinked data, leaving the version odd, so every optimistic reader fails.
+        void retire() const { begin_write(); mtx.unlock(); }
+
+        // An odd version means a writer is active, the read will not validate.
+        version_t read_begin() const { return version.load(std::memory_order_acquire); }
+        bool read_validate(const version_t v) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return v % 2 == 0 && version.load(std::memory_order_relaxed) == v;
+        }
+    };
+
+#if defined(__SANITIZE_THREAD__)
+    extern "C" void AnnotateIgnoreReadsBegin(const char *file, int line);
+    extern "C" void AnnotateIgnoreReadsEnd(const char *file, int line);
+#endif
+
+    // Optimistic reads race with writers by design, they are validated afterwards.
+    // ThreadSanitizer is told to ignore them, suppressions need stacks it cannot always restore.
+    struct OptimisticReadScope {
+#if defined(__SANITIZE_THREAD__)
+        OptimisticReadScope() { AnnotateIgnoreReadsBegin(__FILE__, __LINE__); }
+        ~OptimisticReadScope() { AnnotateIgnoreReadsEnd(__FILE__, __LINE__); }
+#else
+        OptimisticReadScope() {}
+#endif
     };
 }
 
@@ -38,42 +90,41 @@ namespace {
     class ParallelIntervalTreeNode {
     public:
         typedef T value_t;
-        typedef Point<T> P;
+        typedef typename Interval::P P;
         typedef Interval I;
 
         ParallelIntervalTreeNode(const P &begin, const P &end, ParallelIntervalTreeNode* left, ParallelIntervalTreeNode *right)
-            : begin(begin), end(end), max(end), multip(1), is_null(false), left(left), right(right) {}
+            : begin(begin), end(end), max(end), low(end[0]), multip(1), size(1), left(left), right(right) {}
 
         ParallelIntervalTreeNode(const P &begin, const P &end) 
-            : ParallelIntervalTreeNode(begin, end, new ParallelIntervalTreeNode(), new ParallelIntervalTreeNode()) {}
+            : ParallelIntervalTreeNode(begin, end, nullptr, nullptr) {}
+
+        // Takes over the endpoints, only max is a copy.
+        ParallelIntervalTreeNode(P &&begin, P &&end)
+            : begin(std::move(begin)), end(std::move(end)), max(this->end), low(this->end[0]), multip(1), size(1), left(nullptr), right(nullptr) {}
 
         ParallelIntervalTreeNode(const Interval &I, ParallelIntervalTreeNode* left, ParallelIntervalTreeNode *right)
             : ParallelIntervalTreeNode(I.begin, I.end, left, right) {}
 
         ParallelIntervalTreeNode(const Interval &I) 
-            : ParallelIntervalTreeNode(I.begin, I.end, new ParallelIntervalTreeNode(), new ParallelIntervalTreeNode()) {}
-
-        ParallelIntervalTreeNode()
-            : is_null(true) {}
+            : ParallelIntervalTreeNode(I.begin, I.end, nullptr, nullptr) {}
 
         // Lock for read or write locking current node
         ReadWriteLock rw_lock;
         P begin;
         P end;
         P max;
+        // Least end[0] of the subtree, see assign_low. Like max, a remove may leave it below the true value until repaired.
+        T low;
         size_t multip;
-        bool is_null;
+        // Weight of the subtree for balancing, the sum of multip values. Written under the lock of the node,
+        // but writers balancing the parent read it without locking.
+        std::atomic<size_t> size;
+        // Missing children are nullptr, the link is guarded by the lock of this node.
         ParallelIntervalTreeNode *left, *right;
 
+        // Children are freed by the tree, through its allocator.
         ~ParallelIntervalTreeNode() {
-            if (!is_null) {
-                left->rw_lock.lock_write();
-                delete left;
-
-                right->rw_lock.lock_write();
-                delete right;
-            }
-
             // Unlock the mutex of this node, because destructing a mutex while it is locked is UB.
             rw_lock.unlock_write();
         }
@@ -86,483 +137,1212 @@ namespace {
 // NOTE: https://www.guru99.com/avl-tree.html
 // NOTE: http://www.davismol.net/2016/02/07/data-structures-augmented-interval-tree-to-search-for-interval-overlapping/
 
-template <typename T>
+template <typename T, size_t D = DYNAMIC_DIM, class Alloc = HeapAllocator>
 class ParallelIntervalTree {
 public:
     typedef T value_t;
-    typedef Point<T> P;
-    typedef Interval<T> I;
-    typedef ParallelIntervalTreeNode<Interval<T>> Node;
-    ParallelIntervalTree(const size_t dim) : node_count(0), ops_until_rebalance(2), dim(dim), root(new Node()) {}
+    typedef Point<T, D> P;
+    typedef Interval<T, D> I;
+    typedef ParallelIntervalTreeNode<I> Node;
+    ParallelIntervalTree(const size_t dim) : dim(dim), root(nullptr) {}
     ParallelIntervalTree() : ParallelIntervalTree(1) {}
 
     void insert(const I &interval) { insert(interval.begin, interval.end); }
+    void insert(I &&interval) { insert(std::move(interval.begin), std::move(interval.end)); }
     void insert(const P &begin, const P &end) { node_insert(begin, end); }
+    // The endpoints are moved into the new node, and left as they are if the interval is already stored.
+    void insert(P &&begin, P &&end) { node_insert(std::move(begin), std::move(end)); }
+    // Inserts I(args...)
+    template <class... Args>
+    void emplace(Args&&... args) { insert(I(std::forward<Args>(args)...)); }
 
     void remove(const I &interval) { remove(interval.begin, interval.end); }
     void remove(const P &begin, const P &end) { 
         node_remove(begin, end);
     }
 
-    size_t query(const P &p) const { return node_query(p); }
+    // Removes every interval ending before watermark, all_less(end, watermark), returns how many, copies included.
+    // Subtrees whose max is below the watermark are unlinked whole, each by one locked descent, the ones whose low is
+    // not are never entered. The tree lock is not taken, writers elsewhere go on meanwhile, see node_prune.
+    size_t prune_before(const P &watermark) { return node_prune(watermark); }
+
+    // Applies the tasks of [first, last) (see Task), returns the query results in task order, 0 for the others.
+    // Updates go first: the updates of each interval are replayed in task order against its stored multiplicity,
+    // a remove of a copy that is not there does nothing, then every net change reaches its node in a single
+    // traversal, locking each node on the way once, with disjoint subtrees handled in parallel.
+    // Every query is answered after all the updates of the batch, whatever its position in it.
+    template <class InputIt>
+    std::vector<size_t> apply_batch(InputIt first, InputIt last, const size_t threads = std::thread::hardware_concurrency()) {
+        std::vector<size_t> results(std::distance(first, last), 0);
+        std::vector<I> updates;
+        std::vector<bool> inserting;
+        for (InputIt it = first; it != last; ++it) {
+            if (it->method == TaskMethods::INSERT || it->method == TaskMethods::REMOVE) {
+                updates.emplace_back(it->a, it->b);
+                inserting.push_back(it->method == TaskMethods::INSERT);
+            }
+        }
+
+        // Net the updates of each interval, in task order
+        std::vector<size_t> order(updates.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        parallel_sort(order.begin(), order.end(), [&updates](const size_t i, const size_t j) {
+            return updates[i] < updates[j] || (!(updates[j] < updates[i]) && i < j);
+        }, threads);
+        BatchGroup inserts, removes;
+        std::vector<I> structural;
+        for (size_t i = 0; i < order.size(); ) {
+            const I &key = updates[order[i]];
+            size_t end = i;
+            bool removing = false;
+            for (; end < order.size() && !(key < updates[order[end]]); ++end) removing |= !inserting[order[end]];
+            // Only a remove needs to know what is stored
+            const size_t stored = removing ? node_multip_optimistic(key.begin, key.end) : 0;
+            size_t count = stored;
+            for (; i < end; ++i) {
+                if (inserting[order[i]]) ++count;
+                else if (count > 0) --count;
+            }
+            if (count > stored) {
+                inserts.add(key, count - stored);
+            }
+            else if (count < stored) {
+                // The last copy of an interval is removed by node_remove, that restructures the tree.
+                if (count == 0) {
+                    structural.push_back(key);
+                    if (stored > 1) removes.add(key, stored - 1);
+                }
+                else {
+                    removes.add(key, stored - count);
+                }
+            }
+        }
+
+        node_batch(inserts, true, threads);
+        node_batch(removes, false, threads);
+        for (const I &key : structural) node_remove(key.begin, key.end);
+
+        size_t i = 0;
+        for (InputIt it = first; it != last; ++it, ++i) {
+            if (it->method == TaskMethods::QUERY) results[i] = query(it->a);
+        }
+        return results;
+    }
+
+    // Replaces the contents with the intervals of [first, last): sorted (in parallel for large inputs),
+    // duplicates collapsed, then built perfectly balanced in one pass without taking node locks.
+    // The new tree is published at once, operations still running in the old one are waited for.
+    template <class InputIt>
+    void build(InputIt first, InputIt last) {
+        StatsScope scope(tree_stats);
+        TreeStats::Timer timer(tree_stats, STAT_BUILD_NS);
+        tree_stats.add(STAT_BUILDS);
+        std::vector<I> intervals(first, last);
+        const std::vector<size_t> multips = sort_collapse(intervals);
+        publish(node_build(intervals, multips, 0, intervals.size()));
+    }
+
+    // Replaces the contents with sorted, distinct intervals stored multips[i] times each.
+    void build_sorted(const std::vector<I> &intervals, const std::vector<size_t> &multips) {
+        StatsScope scope(tree_stats);
+        TreeStats::Timer timer(tree_stats, STAT_BUILD_NS);
+        tree_stats.add(STAT_BUILDS);
+        publish(node_build(intervals, multips, 0, intervals.size()));
+    }
+
+    // Removes every interval, like building from an empty range.
+    void clear() {
+        const I *none = nullptr;
+        build(none, none);
+    }
+
+    // Stabbing queries and count_overlap take no locks, see node_count_optimistic.
+    size_t query(const P &p) const { return node_count_optimistic(p, p, true); }
+
+    // Intervals containing p, or overlapping [begin,end). An interval stored with
+    // multiplicity k is written k times, the visitor gets f(begin, end, multip) once.
+    // The visitor runs while the node is read locked, so it must not modify the tree.
+    template <class OutputIt>
+    OutputIt query(const P &p, OutputIt out) const { return write_intervals(p, p, true, out); }
+    template <class F>
+    void visit(const P &p, F f) const { node_visit(p, p, true, f); }
+
+    template <class OutputIt>
+    OutputIt query_overlap(const P &begin, const P &end, OutputIt out) const { return write_intervals(begin, end, false, out); }
+    template <class F>
+    void visit_overlap(const P &begin, const P &end, F f) const { node_visit(begin, end, false, f); }
+    size_t count_overlap(const P &begin, const P &end) const {
+        return node_count_optimistic(begin, end, false);
+    }
+
+    // Number of nodes a stabbing query at p visits, shows how tight the max values prune.
+    size_t query_visits(const P &p) const {
+        size_t visited = 0;
+        node_count_optimistic(p, p, true, &visited);
+        return visited;
+    }
+
+    // Every interval in key order, f(begin, end, multip), from a consistent snapshot: new operations
+    // wait until the walk is done, the ones already inside the tree are caught up with.
+    template <class F>
+    void visit_all(F f) const {
+        StatsScope scope(tree_stats);
+        if (const Node *node = lock_root(false)) node_visit_all(node, f);
+    }
+
+    // Counters of the operations so far (only with PIT_STATS defined), and the shape of the tree.
+    // The shape is walked like visit_all, writers wait meanwhile.
+    TreeStatsSnapshot stats() const {
+        TreeStatsSnapshot snapshot;
+        tree_stats.collect(snapshot);
+        if (const Node *node = lock_root(false)) node_shape(node, 1, snapshot);
+        else snapshot.null_nodes = 1;
+        return snapshot;
+    }
+    void reset_stats() { tree_stats.reset(); }
 
     // 1D print
     void print() const { node_print(root); }
 
     ~ParallelIntervalTree() {
         rw_lock.lock_write();
-        root->rw_lock.lock_write();
-        delete root;
+        // An allocator releasing in bulk drops the live nodes together with its slabs.
+        if (root && !(Alloc::releases_in_bulk && std::is_trivially_destructible<P>::value)) {
+            node_free(alloc, root);
+        }
         rw_lock.unlock_write();
+        // Retired nodes still in limbo are freed by the epoch domain, before the allocator is destroyed.
+    }
+
+    // Reclamation counters: nodes unlinked so far, and how many of them are already freed.
+    size_t retired_nodes() const { return epochs.retired(); }
+    size_t reclaimed_nodes() const { return epochs.reclaimed(); }
+
+    // Checks the invariants with no writer running: keys in order, no empty node, and max, low and weight
+    // of every node as recomputed from its children. For tests, it does not lock.
+    bool valid() const {
+        TraversalStack<const Node*> stack;
+        const Node *node = root, *previous = nullptr;
+        while (node || !stack.empty()) {
+            for (; node; node = node->left) stack.push(node);
+            node = stack.pop();
+            if (previous && !interval_less(previous->begin, previous->end, node->begin, node->end)) return false;
+            P max = node->max;
+            T low = node->low;
+            if (assign_max(max, node->end, node->left ? &node->left->max : nullptr, node->right ? &node->right->max : nullptr)) return false;
+            if (assign_low(low, node->end, node->left ? &node->left->low : nullptr, node->right ? &node->right->low : nullptr)) return false;
+            if (node->multip == 0 || weight(node) != weight(node->left) + weight(node->right) - 1 + node->multip) return false;
+            previous = node;
+            node = node->right;
+        }
+        return true;
     }
 private:
+    // Guards root, its version lets optimistic readers detect a replaced root.
     ReadWriteLock rw_lock;
-    size_t node_count;
-    size_t ops_until_rebalance;
+
+    Alloc alloc;
+
+    // Optimistic readers pin this domain, so unlinked nodes are freed only once no reader can reach them.
+    mutable EpochDomain epochs;
+#ifdef PIT_STATS
+    TreeStats tree_stats;
+#else
+    static constexpr TreeStats tree_stats{};
+#endif
+
+    // The node must be write locked and unlinked, its children too, the writer does not touch it afterwards.
+    void retire(Node *node) {
+        node->rw_lock.retire();
+        epochs.retire(node, free_node, &alloc);
+    }
+    static void free_node(void *ptr, void *alloc) {
+        // Retired nodes have no children, except the root of a tree replaced by build or of a pruned subtree.
+        node_free(*static_cast<Alloc*>(alloc), static_cast<Node*>(ptr));
+    }
+    // Frees an unreachable subtree, see free_subtree. Every node is write locked right before it goes,
+    // the destructor unlocks it.
+    static void node_free(Alloc &alloc, Node *node) {
+        free_subtree(alloc, node, [](Node *n) { n->rw_lock.lock_write(); });
+    }
 
     void node_print(Node *node) const {
-        if (!node->is_null) {
+        if (node) {
             std::cout << "("; node_print(node->left);
             std::cout << "," << node->begin[0] << "-" << node->end[0]  << "-" << node->max[0] << ",";
             node_print(node->right); std::cout << ")";
         }
     }
 
-    int node_height(Node *node) {
-        if (node->left && node->right) {
-            return max(node->left->height, node->right->height) + 1;
-        } else if (node->left) {
-            return node->left->height + 1;
-        } else if (node->right) {
-            return node->right->height + 1;
-        } else {
-            return 1;
+    // Swaps in a tree built off to the side.
+    void publish(Node *built) {
+        Node *old = lock_tree();
+        rw_lock.begin_write();
+        root = built;
+        if (old) {
+            retire_subtree(old);
+            epochs.retire(old, free_node, &alloc);
         }
+        rw_lock.unlock_write();
     }
-    int node_bf(Node *node) {
-        if (node->left && node->right) {
-            return node->left->height - node->right->height;
-        } else if (node->left) {
-            return node->left->height;
-        } else if (node->right) {
-            return -node->right->height;
-        } else {
-            return 0;
-        }
+
+    Node *node_build(const std::vector<I> &intervals, const std::vector<size_t> &multips, const size_t lo, const size_t hi) {
+        if (lo == hi) return nullptr;
+        const size_t mid = lo + (hi - lo) / 2;
+        Node *left = node_build(intervals, multips, lo, mid);
+        Node *right = node_build(intervals, multips, mid + 1, hi);
+        Node *node = alloc.template create<Node>(intervals[mid], left, right);
+        node->multip = multips[mid];
+        node_update(node);
+        return node;
     }
-    P &node_max(Node *node) {
-        if (node->left && node->right) {
-            return max(node->end, max(node->left->max, node->right->max));
-        } else if (node->left) {
-            return max(node->end, node->left->max);
-        } else if (node->right) {
-            return max(node->end, node->right->max);
-        } else {
-            return node->end;
+
+    // Netted updates of a batch in key order, counts[i] copies of keys[i] are inserted (or removed).
+    struct BatchGroup {
+        std::vector<I> keys;
+        std::vector<size_t> counts;
+        std::vector<size_t> prefix{0};
+        // Copies of keys[i] a remove did not find, the weight taken for them on the way down is given back.
+        std::vector<size_t> missing;
+
+        void add(const I &key, const size_t count) {
+            keys.push_back(key);
+            counts.push_back(count);
+            prefix.push_back(prefix.back() + count);
+            missing.push_back(0);
+        }
+        size_t total(const size_t lo, const size_t hi) const { return prefix[hi] - prefix[lo]; }
+        // First key of [lo,hi) not less than the key of node
+        size_t split(const size_t lo, const size_t hi, const Node *node) const {
+            return std::lower_bound(keys.begin() + lo, keys.begin() + hi, node, [](const I &key, const Node *node) {
+                return interval_less(key.begin, key.end, node->begin, node->end);
+            }) - keys.begin();
+        }
+        bool matches(const size_t i, const size_t hi, const Node *node) const {
+            return i < hi && keys[i].begin == node->begin && keys[i].end == node->end;
+        }
+    };
+
+    // Below this many updates on both sides, a batch does not fork.
+    static constexpr size_t BATCH_PARALLEL_MIN = 1024;
+
+    void node_batch(BatchGroup &group, const bool inserting, const size_t threads) {
+        const size_t n = group.keys.size();
+        if (n == 0) return;
+        StatsScope scope(tree_stats);
+        Node *top = lock_root(true);
+        if (!top) {
+            if (!inserting) return;
+            if (!create_root([&] { return node_build(group.keys, group.counts, 0, n); })) {
+                return node_batch(group, inserting, threads);
+            }
+        }
+        else {
+            auto deltas = [this, &group, inserting, n](const Node *current) { return batch_deltas(group, inserting, current, 0, n); };
+            Node *node = node_balance(root, rw_lock, top, deltas);
+            rw_lock.end_write();
+            node_batch(node, group, 0, n, inserting, threads);
+            for (size_t i = 0; i < n; ++i) {
+                if (group.missing[i] > 0) node_restore(group.keys[i].begin, group.keys[i].end, group.missing[i]);
+            }
         }
     }
 
-    // SOURCE: http://www.geekviewpoint.com/java/bst/dsw_algorithm
-    void rebalance() {
-        // Get write lock for all nodes
-        lock_all(root);
+    std::pair<long, long> batch_deltas(const BatchGroup &group, const bool inserting, const Node *node, const size_t lo, const size_t hi) const {
+        const size_t mid = group.split(lo, hi, node);
+        const size_t right = group.matches(mid, hi, node) ? mid + 1 : mid;
+        const long sign = inserting ? 1 : -1;
+        return std::make_pair(sign * static_cast<long>(group.total(lo, mid)), sign * static_cast<long>(group.total(right, hi)));
+    }
 
-        if (!root->is_null) {
-            make_vine();
-            balance_vine();
+    void node_batch(Node *node, BatchGroup &group, const size_t lo, const size_t hi, const bool inserting, const size_t threads) {
+        // node must already be write locked, and balanced for the updates [lo,hi) of group
+        // Before return, node must be write unlocked
 
-            // Recalculate max values
-            update_max(root);
+        // Like node_insert and node_remove for all the updates at once: max and weight are updated while going down.
+        if (inserting) {
+            node->size.fetch_add(group.total(lo, hi), std::memory_order_relaxed);
+            for (size_t i = lo; i < hi; ++i) {
+                if (!all_less_equal(group.keys[i].end, node->max)) {
+                    node->rw_lock.begin_write();
+                    extend_max(node->max, group.keys[i].end);
+                }
+                if (group.keys[i].end[0] < node->low) {
+                    node->rw_lock.begin_write();
+                    node->low = group.keys[i].end[0];
+                }
+            }
+        }
+        else {
+            node->size.fetch_sub(group.total(lo, hi), std::memory_order_relaxed);
         }
 
-        // Finally, unlock all nodes
-        unlock_all(root);
-    }
-
-    void make_vine() {
-        Node* gp = nullptr; // nullptr can be used here, we won't lock anything during rebalance.
-        Node* p = root;
-        Node* left;
-        while (!p->is_null) {
-            left = p->left;
-            if (!left->is_null) {
-                gp = rotate_right(gp, p, left);
-                p = left;
+        size_t mid = group.split(lo, hi, node);
+        size_t right_lo = mid;
+        if (group.matches(mid, hi, node)) {
+            node->rw_lock.begin_write();
+            if (inserting) {
+                node->multip += group.counts[mid];
             }
             else {
-                gp = p;
-                p = p->right;
+                const size_t removed = std::min(group.counts[mid], node->multip - 1);
+                node->multip -= removed;
+                group.missing[mid] = group.counts[mid] - removed;
             }
+            ++right_lo;
         }
-    }
 
-    Node* rotate_right(Node* gp, Node* p, Node* c) {
-        if (gp == nullptr) {
-            root = c;
+        // Locking children first, then unlocking current node
+        if (threads > 1 && mid - lo >= BATCH_PARALLEL_MIN && hi - right_lo >= BATCH_PARALLEL_MIN) {
+            // A lock must be released by its owner, so the left subtree is locked by the thread working on it.
+            std::promise<void> left_locked;
+            std::thread th([&]() {
+                StatsScope scope(tree_stats);
+                Node* left = node_batch_child(node, node->left, group, lo, mid, inserting);
+                left_locked.set_value();
+                if (left) node_batch(left, group, lo, mid, inserting, threads / 2);
+            });
+            left_locked.get_future().wait();
+            Node* right = node_batch_child(node, node->right, group, right_lo, hi, inserting);
+            node->rw_lock.unlock_write();
+            if (right) node_batch(right, group, right_lo, hi, inserting, threads - threads / 2);
+            th.join();
         }
         else {
-            gp->right = c;
+            Node* left = node_batch_child(node, node->left, group, lo, mid, inserting);
+            Node* right = node_batch_child(node, node->right, group, right_lo, hi, inserting);
+            node->rw_lock.unlock_write();
+            if (left) node_batch(left, group, lo, mid, inserting, threads);
+            if (right) node_batch(right, group, right_lo, hi, inserting, threads);
         }
-        p->left = c->right;
-        c->right = p;
-        return gp;
     }
 
-    void rotate_left(Node* gp, Node* p, Node* c) {
-        if (gp == nullptr) {
-            root = c;
-        }
-        else {
-            gp->right = c;
+    Node *node_batch_child(Node *node, Node *&slot, BatchGroup &group, const size_t lo, const size_t hi, const bool inserting) {
+        // node must be write locked, returns the locked and balanced child taking the updates [lo,hi),
+        // or nullptr if there is nothing left to do there. New intervals into an empty slot are built as a subtree.
+        if (lo == hi) return nullptr;
+        if (!slot) {
+            if (inserting) {
+                node->rw_lock.begin_write();
+                slot = node_build(group.keys, group.counts, lo, hi);
+            }
+            else {
+                for (size_t i = lo; i < hi; ++i) group.missing[i] = group.counts[i];
+            }
+            return nullptr;
         }
-        p->right = c->left;
-        c->left = p;
+        slot->rw_lock.lock_write();
+        auto deltas = [this, &group, inserting, lo, hi](const Node *current) { return batch_deltas(group, inserting, current, lo, hi); };
+        return node_balance(slot, node->rw_lock, slot, deltas);
     }
 
-    void balance_vine() {
-        size_t n = node_count;
-        size_t m = greatest_power_of_two_lt(n) - 1;
-        make_rotations(n - m);
-        while (m > 1) {
-            m /= 2;
-            make_rotations(m);
-        }
+    // Releases the locks of a subtree locked by lock_all, leaving it unreadable for optimistic readers.
+    void retire_subtree(Node* node) {
+        for_subtree(node, [](Node *n) { n->rw_lock.retire(); });
     }
 
-    size_t greatest_power_of_two_lt(size_t n) {
-        size_t msb = 0;
-        while (n > 1) {
-            n >>= 1;
-            ++msb;
-        }
-        return 1 << msb;
+    // Parents are locked before their children, in the order writers lock.
+    void lock_all(Node* node) {
+        for_subtree(node, [](Node *n) {
+            n->rw_lock.lock_write();
+            n->rw_lock.begin_write();
+        });
     }
 
-    void make_rotations(size_t bound) {
-        Node* gp = nullptr;
-        Node* p = root;
-        if (p->is_null) return;
-        Node* c = root->right;
-        for (; bound > 0; --bound) {
-            if (c->is_null) break;
-            rotate_left(gp, p, c);
-            gp = c;
-            if (gp->is_null) break;
-            p = gp->right;
-            if (p->is_null) break;
-            c = p->right;
+    // f(node) on every node of the subtree, parents first (pre-order). The children are read after f.
+    template <class F>
+    static void for_subtree(Node *node, F f) {
+        TraversalStack<Node*> stack;
+        while (node || !stack.empty()) {
+            if (!node) node = stack.pop();
+            f(node);
+            if (node->right) stack.push(node->right);
+            node = node->left;
         }
     }
 
-    P update_max(Node* node) {
-        if (node->left->is_null && node->right->is_null) {
-            node->max = node->end;
-        }
-        else if (node->left->is_null) {
-            node->max = max(node->end, update_max(node->right));
+    // The root link, read like an optimistic reader does.
+    Node *read_root() const {
+        OptimisticReadScope scope;
+        while (true) {
+            const ReadWriteLock::version_t version = rw_lock.read_begin();
+            Node *node = root;
+            if (rw_lock.read_validate(version)) return node;
+            std::this_thread::yield();
         }
-        else if (node->right->is_null) {
-            node->max = max(node->end, update_max(node->left));
+    }
+
+    // A single read of the root link, false while it is being replaced. Holding a node lock, nobody waits for the
+    // root link: a writer replacing the root from below may be waiting for that very node.
+    bool is_root(const Node *node) const {
+        OptimisticReadScope scope;
+        const ReadWriteLock::version_t version = rw_lock.read_begin();
+        return root == node && rw_lock.read_validate(version);
+    }
+
+    // Operations do not take the tree lock. Whoever replaces the root holds the write lock of the current
+    // root (whole tree operations take both), so a root still in place once locked stays there, and the
+    // version of rw_lock alone guards the link. Returns the root read or write locked, nullptr if the tree is empty.
+    Node *lock_root(const bool write) const {
+        // A root replaced meanwhile may be retired, the epoch keeps it allocated while it is locked.
+        EpochDomain::Guard guard(epochs);
+        while (Node *node = read_root()) {
+            if (write) node->rw_lock.lock_write();
+            else node->rw_lock.lock_read();
+            if (is_root(node)) return node;
+            if (write) node->rw_lock.unlock_unchanged();
+            else node->rw_lock.unlock_read();
         }
-        else {
-            node->max = max(node->end, max(update_max(node->left), update_max(node->right)));
+        return nullptr;
+    }
+
+    // Sets the root of an empty tree to make(), under the tree lock. False if the tree is not empty anymore.
+    template <class Make>
+    bool create_root(Make make) {
+        rw_lock.lock_write();
+        if (read_root()) {
+            rw_lock.unlock_write();
+            return false;
         }
-        return node->max;
+        Node *node = make();
+        rw_lock.begin_write();
+        root = node;
+        rw_lock.unlock_write();
+        return true;
     }
 
-    void lock_all(Node* node) {
-        node->rw_lock.lock_write();
-        if (!node->is_null) {
+    // Stops the world for whole tree operations: the tree lock keeps out new roots, then every node is write locked.
+    // Returns the root, the caller unlocks the tree lock.
+    Node *lock_tree() {
+        rw_lock.lock_write();
+        Node *node = lock_root(true);
+        if (node) {
+            node->rw_lock.begin_write();
             lock_all(node->left);
             lock_all(node->right);
         }
+        return node;
     }
 
-    void unlock_all(Node* node) {
-        node->rw_lock.unlock_write();
-        if (!node->is_null) {
-            unlock_all(node->left);
-            unlock_all(node->right);
-        }
+    // Writers hold the tree lock only as the parent of the root by its version, see lock_root.
+    void unlock_parent(const ReadWriteLock &parent_lock) const {
+        if (&parent_lock == &rw_lock) parent_lock.end_write();
+        else parent_lock.unlock_write();
     }
 
-    void check_rebalance(int op_cost, int count_change) {
-        rw_lock.lock_write();
-        node_count += count_change;
-        if (ops_until_rebalance > static_cast<size_t>(op_cost)) {
-            ops_until_rebalance -= op_cost;
-        }
-        else if (node_count > 2) {
-            rebalance();
-            ops_until_rebalance = max(static_cast<size_t>(3), static_cast<size_t>(floor(sqrt(node_count))));
+    // Weight balance parameters, a child may weigh at most BALANCE_DELTA times its sibling.
+    // A heavy inner grandchild (BALANCE_GAMMA times its sibling) needs a double rotation.
+    static constexpr size_t BALANCE_DELTA = 3;
+    static constexpr size_t BALANCE_GAMMA = 2;
+
+    static size_t weight(const Node *node) { return node ? node->size.load(std::memory_order_relaxed) + 1 : 1; }
+
+    // Recomputes size, max and low of node from its children, all of them must be write locked.
+    static void node_update(Node *node) {
+        node->size.store(weight(node->left) + weight(node->right) - 2 + node->multip, std::memory_order_relaxed);
+        assign_max(node->max, node->end, node->left ? &node->left->max : nullptr, node->right ? &node->right->max : nullptr);
+        assign_low(node->low, node->end, node->left ? &node->left->low : nullptr, node->right ? &node->right->low : nullptr);
+    }
+
+    static void lock_write(Node *node) { if (node) node->rw_lock.lock_write(); }
+    static void unlock_write(Node *node) { if (node) node->rw_lock.unlock_write(); }
+
+    // Top-down balancing: before a writer moves below node, the subtree is rotated if the child on its path,
+    // with the weight it is about to gain (delta=1) or lose (delta=-1), gets too heavy or too light for its sibling.
+    // slot is the link to node, its owner (the parent, or the tree for root) and node must be write locked.
+    // Returns the node in slot afterwards, it is write locked, the other nodes touched are unlocked.
+    Node *node_balance(Node *&slot, const ReadWriteLock &parent_lock, Node *node, const P &begin, const P &end, const int delta) {
+        auto deltas = [&begin, &end, delta](const Node *current) {
+            if (begin==current->begin && end==current->end) return std::make_pair(0L, 0L);
+            const bool go_left = !interval_less(current->begin, current->end, begin, end);
+            return go_left ? std::make_pair(static_cast<long>(delta), 0L) : std::make_pair(0L, static_cast<long>(delta));
+        };
+        return node_balance(slot, parent_lock, node, deltas);
+    }
+
+    // Same for a writer moving below node on both sides, deltas(node) is the weight change of its left and right subtree.
+    template <class Deltas>
+    Node *node_balance(Node *&slot, const ReadWriteLock &parent_lock, Node *node, Deltas &deltas) {
+        for (int i = 0; i < 2; ++i) {
+            const std::pair<long, long> d = deltas(node);
+            const long l = std::max(1L, static_cast<long>(weight(node->left)) + d.first);
+            const long r = std::max(1L, static_cast<long>(weight(node->right)) + d.second);
+            if (r > static_cast<long>(BALANCE_DELTA) * l) node = node_rotate_left(slot, parent_lock, node);
+            else if (l > static_cast<long>(BALANCE_DELTA) * r) node = node_rotate_right(slot, parent_lock, node);
+            else break;
         }
-        rw_lock.unlock_write();
+        return node;
     }
 
-    void node_insert(const P &begin, const P &end) {
-        rw_lock.lock_write();
-        root->rw_lock.lock_write();
-        int change = 0;
-        if (root->is_null) {
-            delete root;
-            root = new Node(begin, end);
-            change = 1;
-            rw_lock.unlock_write();
+    // Moves node down to the left, with a single rotation, or a double one if the inner grandchild is heavy.
+    // Locks both children of node and the grandchildren that move, in pre-order.
+    Node *node_rotate_left(Node *&slot, const ReadWriteLock &parent_lock, Node *node) {
+        Node *left = node->left, *right = node->right;
+        if (!right) return node;
+        lock_write(left);
+        right->rw_lock.lock_write();
+        Node *inner = right->left, *outer = right->right;
+        lock_write(inner);
+        lock_write(outer);
+        parent_lock.begin_write();
+        node->rw_lock.begin_write();
+        right->rw_lock.begin_write();
+
+        if (!inner || weight(inner) < BALANCE_GAMMA * weight(outer)) {
+            tree_stats.add(STAT_ROTATIONS_RR);
+            node->right = inner;
+            right->left = node;
+            slot = right;
+            node_update(node);
+            node_update(right);
+            unlock_write(left);
+            unlock_write(inner);
+            unlock_write(outer);
+            node->rw_lock.unlock_write();
+            return right;
         }
-        else {
-            rw_lock.unlock_write();
-            node_insert(root, begin, end, change);
+
+        Node *inner_left = inner->left, *inner_right = inner->right;
+        lock_write(inner_left);
+        lock_write(inner_right);
+        inner->rw_lock.begin_write();
+        tree_stats.add(STAT_ROTATIONS_RL);
+        node->right = inner_left;
+        right->left = inner_right;
+        inner->left = node;
+        inner->right = right;
+        slot = inner;
+        node_update(node);
+        node_update(right);
+        node_update(inner);
+        unlock_write(left);
+        unlock_write(inner_left);
+        unlock_write(inner_right);
+        unlock_write(outer);
+        node->rw_lock.unlock_write();
+        right->rw_lock.unlock_write();
+        return inner;
+    }
+
+    Node *node_rotate_right(Node *&slot, const ReadWriteLock &parent_lock, Node *node) {
+        Node *left = node->left, *right = node->right;
+        if (!left) return node;
+        left->rw_lock.lock_write();
+        Node *outer = left->left, *inner = left->right;
+        lock_write(outer);
+        lock_write(inner);
+        lock_write(right);
+        parent_lock.begin_write();
+        node->rw_lock.begin_write();
+        left->rw_lock.begin_write();
+
+        if (!inner || weight(inner) < BALANCE_GAMMA * weight(outer)) {
+            tree_stats.add(STAT_ROTATIONS_LL);
+            node->left = inner;
+            left->right = node;
+            slot = left;
+            node_update(node);
+            node_update(left);
+            unlock_write(right);
+            unlock_write(inner);
+            unlock_write(outer);
+            node->rw_lock.unlock_write();
+            return left;
         }
 
-        check_rebalance(change, change);
+        Node *inner_left = inner->left, *inner_right = inner->right;
+        lock_write(inner_left);
+        lock_write(inner_right);
+        inner->rw_lock.begin_write();
+        tree_stats.add(STAT_ROTATIONS_LR);
+        node->left = inner_right;
+        left->right = inner_left;
+        inner->left = left;
+        inner->right = node;
+        slot = inner;
+        node_update(node);
+        node_update(left);
+        node_update(inner);
+        unlock_write(right);
+        unlock_write(inner_left);
+        unlock_write(inner_right);
+        unlock_write(outer);
+        node->rw_lock.unlock_write();
+        left->rw_lock.unlock_write();
+        return inner;
     }
 
-    void node_insert(Node *node, const P &begin, const P &end, int& change) {
-        // node must already be write locked
+    // B and E are const P& or P, the new node copies or takes over the endpoints.
+    template <class B, class E>
+    void node_insert(B &&begin, E &&end) {
+        StatsScope scope(tree_stats);
+        Node *top = lock_root(true);
+        if (!top) {
+            // make() runs only if the root is set, the endpoints are still there for the retry.
+            if (!create_root([&] { return alloc.template create<Node>(std::forward<B>(begin), std::forward<E>(end)); })) {
+                node_insert(std::forward<B>(begin), std::forward<E>(end));
+            }
+            return;
+        }
+        Node *node = node_balance(root, rw_lock, top, begin, end, 1);
+        rw_lock.end_write();
+        node_insert(node, std::forward<B>(begin), std::forward<E>(end));
+    }
+
+    template <class B, class E>
+    void node_insert(Node *node, B &&begin, E &&end) {
+        // node must already be write locked, and balanced for this insert
         // Before return, node must be write unlocked
         // node should never be null
 
-        // Does not rebalance the tree!
-
-        // The new interval will be inserted in this subtree, so update max, while going down.
-        // Any operation coming from above this insert cannot overtake, so from their point of view the tree is consistent.
-        node->max = max(node->max, end);
+        while (true) {
+            // The new interval will be inserted in this subtree, so update max and weight, while going down.
+            // Any operation coming from above this insert cannot overtake, so from their point of view the tree is consistent.
+            node->size.fetch_add(1, std::memory_order_relaxed);
+            if (!all_less_equal(end, node->max)) {
+                node->rw_lock.begin_write();
+                extend_max(node->max, end);
+            }
+            if (end[0] < node->low) {
+                node->rw_lock.begin_write();
+                node->low = end[0];
+            }
 
-        if (begin <= node->begin) {
-            if (begin==node->begin && end==node->end) {
+            const bool go_left = !interval_less(node->begin, node->end, begin, end);
+            if (go_left && begin==node->begin && end==node->end) {
+                node->rw_lock.begin_write();
                 node->multip += 1;
                 node->rw_lock.unlock_write();
-                change = 0;
                 return;
             }
 
-            // Locking left, then unlocking current node before returning
-            node->left->rw_lock.lock_write();
-            if (node->left->is_null) {
-                delete node->left;
-                node->left = new Node(begin, end);
+            // Locking the child, then unlocking current node before moving down
+            Node *&child = go_left ? node->left : node->right;
+            if (!child) {
+                node->rw_lock.begin_write();
+                child = alloc.template create<Node>(std::forward<B>(begin), std::forward<E>(end));
                 node->rw_lock.unlock_write();
-                change = 1;
                 return;
             }
-            else {
-                Node* left = node->left;
-                node->rw_lock.unlock_write();
-                node_insert(left, begin, end, change);
-                return;
+            child->rw_lock.lock_write();
+            Node *next = node_balance(child, node->rw_lock, child, begin, end, 1);
+            node->rw_lock.unlock_write();
+            node = next;
+        }
+    }
+
+    // Returns whether a copy of the interval was found and removed.
+    bool node_remove(const P &begin, const P &end) {
+        // Intervals that are not stored are not looked for under locks,
+        // the weights decreased on the way down would be wrong for them.
+        if (!node_contains_optimistic(begin, end)) return false;
+
+        StatsScope scope(tree_stats);
+        Node *top = lock_root(true);
+        if (!top) return false;
+        int change = 0;
+        std::vector<Node*> stale;
+        Node *node = node_balance(root, rw_lock, top, begin, end, -1);
+        const bool found = node_remove(root, rw_lock, node, begin, end, change, stale);
+        if (change != 0) repair_max(stale);
+        for (Node *kept : stale) kept->rw_lock.unlock_write();
+        // Another remover took the interval after it was checked for.
+        if (!found) node_restore(begin, end, 1);
+        return found;
+    }
+
+    bool node_remove(Node *&root_slot, const ReadWriteLock &root_lock, Node *node, const P &begin, const P &end, int& change, std::vector<Node*> &stale) {
+        // parent_lock (owning slot, the link to node) and node must be write locked, and node balanced for this remove,
+        // must unlock both before returning. The parent stays locked until node is known to stay in place.
+        // The nodes whose max or low may have been reached by end only are added to stale, top-down. They stay
+        // write locked for the caller: until they are repaired no other writer reads them or moves them around.
+        Node **slot = &root_slot;
+        const ReadWriteLock *parent_lock = &root_lock;
+        bool node_stale = false, parent_stale = false;
+        auto release = [this](const ReadWriteLock &lock, const bool kept) { if (!kept) unlock_parent(lock); };
+
+        while (true) {
+            node->size.fetch_sub(1, std::memory_order_relaxed);
+            node_stale = !all_less(end, node->max) || !(node->low < end[0]);
+            if (node_stale) stale.push_back(node);
+
+            const bool go_left = !interval_less(node->begin, node->end, begin, end);
+            if (go_left && begin==node->begin && end==node->end) {
+                node->rw_lock.begin_write();
+                if (node->multip > 1) {
+                    node->multip -= 1;
+                    release(node->rw_lock, node_stale);
+                    release(*parent_lock, parent_stale);
+                    change = 0;
+                    return true;
+                }
+                change = -1;
+                if (!node->left || !node->right) {
+                    // At most one child, that takes the place of node.
+                    parent_lock->begin_write();
+                    *slot = node->left ? node->left : node->right;
+                    node->left = node->right = nullptr;
+                    if (node_stale) stale.pop_back();
+                    retire(node);
+                    release(*parent_lock, parent_stale);
+                    return true;
+                }
+                release(*parent_lock, parent_stale);
+                node->left->rw_lock.lock_write();
+                Node *up = node_remove_rightmost(node);
+                node->begin = up->begin;
+                node->end = up->end;
+                node->multip = up->multip;
+                retire(up);
+                release(node->rw_lock, node_stale);
+                return true;
             }
+
+            Node *&child = go_left ? node->left : node->right;
+            if (!child) break;
+            child->rw_lock.lock_write();
+            Node *next = node_balance(child, node->rw_lock, child, begin, end, -1);
+            release(*parent_lock, parent_stale);
+            slot = &child;
+            parent_lock = &node->rw_lock;
+            parent_stale = node_stale;
+            node = next;
         }
-        else {
-            // Locking right, then unlocking current node before returning
-            node->right->rw_lock.lock_write();
-            if (node->right->is_null) {
-                delete node->right;
-                node->right = new Node(begin, end);
-                node->rw_lock.unlock_write();
-                change = 1;
-                return;
+        release(node->rw_lock, node_stale);
+        release(*parent_lock, parent_stale);
+        return false;
+    }
+
+    // Gives back count to the weights a remove decreased on its way down to an interval it did not find. They are
+    // short from the root down to where that remove stopped, or to the lowest node a rotation did not recompute from
+    // its children since: the lowest node on the way to the interval that weighs less than its children. With the way
+    // write locked the writers ahead are done with those children, the shortfall is given back bottom-up. Shortfalls
+    // of other removes on the way are alike, whichever is given back first.
+    void node_restore(const P &begin, const P &end, const size_t count) {
+        Node *node = lock_root(true);
+        if (!node) return;
+        std::vector<Node*> path;
+        while (true) {
+            path.push_back(node);
+            if (begin==node->begin && end==node->end) break;
+            Node *child = !interval_less(node->begin, node->end, begin, end) ? node->left : node->right;
+            if (!child) break;
+            child->rw_lock.lock_write();
+            node = child;
+        }
+        size_t given = 0;
+        const Node *below = nullptr;
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            // The child on the path is still locked, the others are read locked.
+            Node *parent = *it, *left = parent->left, *right = parent->right;
+            if (left && left != below) left->rw_lock.lock_read();
+            if (right && right != below) right->rw_lock.lock_read();
+            const size_t children = weight(left) + weight(right) - 2 + parent->multip;
+            if (left && left != below) left->rw_lock.unlock_read();
+            if (right && right != below) right->rw_lock.unlock_read();
+            // A weight short by more than it holds wraps around, the difference is signed.
+            const long missing = static_cast<long>(children - parent->size.load(std::memory_order_relaxed) - given);
+            if (missing > 0) given += std::min(count - given, static_cast<size_t>(missing));
+            parent->size.fetch_add(given, std::memory_order_relaxed);
+            below = parent;
+        }
+        for (Node *parent : path) parent->rw_lock.unlock_write();
+    }
+
+    // A read locked walk finds the subtrees expired as a whole and the expired nodes left above live ones,
+    // each subtree is then unlinked by a locked descent to its top, the nodes left are removed one by one.
+    // A subtree changed by another writer in between is still unlinked if it expired as a whole, left for
+    // the next prune otherwise.
+    size_t node_prune(const P &watermark) {
+        StatsScope scope(tree_stats);
+        std::vector<I> expired;
+        std::vector<std::pair<I, size_t>> singles;
+        if (const Node *node = lock_root(false)) node_prune_collect(node, watermark, expired, singles);
+
+        size_t pruned = 0;
+        for (const I &key : expired) pruned += node_prune(key.begin, key.end, watermark);
+        for (const auto &entry : singles) {
+            for (size_t i = 0; i < entry.second && node_remove(entry.first.begin, entry.first.end); ++i) ++pruned;
+        }
+        return pruned;
+    }
+
+    // Read locks like node_visit. A subtree whose max is below the watermark goes to expired with the key of its top,
+    // one whose low is not has nothing expired, the expired nodes in between go to singles with their multip.
+    void node_prune_collect(const Node *node, const P &watermark, std::vector<I> &expired,
+                            std::vector<std::pair<I, size_t>> &singles) const {
+        // node must already be read locked!
+        // Before return, every node is read unlocked!
+        TraversalStack<const Node*> stack;
+        while (true) {
+            tree_stats.add(STAT_VISITED);
+            if (all_less(node->max, watermark)) {
+                expired.emplace_back(node->begin, node->end);
+                node->rw_lock.unlock_read();
+            }
+            else if (!(node->low < watermark[0])) {
+                node->rw_lock.unlock_read();
             }
             else {
-                Node* right = node->right;
-                node->rw_lock.unlock_write();
-                node_insert(right, begin, end, change);
-                return;
+                // Locking children first, then unlocking current node
+                Node *left = node->left, *right = node->right;
+                if (left) left->rw_lock.lock_read();
+                if (right) right->rw_lock.lock_read();
+                if (all_less(node->end, watermark)) singles.emplace_back(I(node->begin, node->end), node->multip);
+                node->rw_lock.unlock_read();
+                if (right) stack.push(right);
+                if (left) stack.push(left);
             }
+            if (stack.empty()) return;
+            node = stack.pop();
         }
     }
 
-    void node_remove(const P &begin, const P &end) {
-        rw_lock.lock_write();
-        root->rw_lock.lock_write();
-        int change = 0;
-        node_remove(root, begin, end, change, true);
+    // Unlinks the subtree whose top holds the interval, if it is still there and expired as a whole. Returns the
+    // intervals unlinked. The path down stays write locked until that weight is known, and loses exactly it, its max
+    // and low are recomputed bottom-up before anyone else gets in. There are no rotations, the writers coming later
+    // rebalance on their way.
+    size_t node_prune(const P &begin, const P &end, const P &watermark) {
+        Node *node = lock_root(true);
+        if (!node) return 0;
+        std::vector<Node*> path;
+        Node **slot = &root;
+        const ReadWriteLock *parent_lock = &rw_lock;
+        size_t pruned = 0;
+        while (true) {
+            if (begin==node->begin && end==node->end) {
+                pruned = node_prune_subtree(*slot, *parent_lock, node, watermark);
+                if (!pruned) node->rw_lock.unlock_write();
+                else if (path.empty()) rw_lock.end_write();
+                break;
+            }
+            Node *&child = !interval_less(node->begin, node->end, begin, end) ? node->left : node->right;
+            if (!child) {
+                node->rw_lock.unlock_write();
+                break;
+            }
+            child->rw_lock.lock_write();
+            path.push_back(node);
+            slot = &child;
+            parent_lock = &node->rw_lock;
+            node = child;
+        }
+        if (pruned) {
+            const Node *below = nullptr;
+            for (auto it = path.rbegin(); it != path.rend(); ++it) {
+                // The child on the path is still locked, the other one is read locked.
+                Node *parent = *it;
+                Node *other = parent->left == below ? parent->right : parent->left;
+                if (other) other->rw_lock.lock_read();
+                node_repair(parent);
+                if (other) other->rw_lock.unlock_read();
+                below = parent;
+            }
+        }
+        unlock_path(path, pruned);
+        return pruned;
+    }
 
-        check_rebalance(-change, change);
+    // slot, owned by parent_lock, holds node, both write locked. If everything below node ends before the watermark,
+    // the subtree is unlinked and retired together: locking it all waits out the writers still inside.
+    // Returns the intervals unlinked, 0 if node stays, it is still locked.
+    size_t node_prune_subtree(Node *&slot, const ReadWriteLock &parent_lock, Node *node, const P &watermark) {
+        if (!all_less(node->max, watermark)) return 0;
+        node->rw_lock.begin_write();
+        lock_all(node->left);
+        lock_all(node->right);
+        parent_lock.begin_write();
+        slot = nullptr;
+        size_t pruned = 0;
+        for_subtree(node, [&pruned](Node *n) { pruned += n->multip; });
+        retire_subtree(node);
+        epochs.retire(node, free_node, &alloc);
+        return pruned;
     }
 
-    void node_remove(Node *node, const P &begin, const P &end, int& change, const bool is_root = false) {
-        // node must be write locked,
-        // must unlock node before returning.
+    bool node_contains_optimistic(const P &begin, const P &end) const { return node_multip_optimistic(begin, end) != 0; }
+
+    // Lock-free exact match lookup, validated like node_count_optimistic. Returns 0 if the interval is not stored.
+    size_t node_multip_optimistic(const P &begin, const P &end) const {
+        EpochDomain::Guard guard(epochs);
+        OptimisticReadScope scope;
+        while (true) {
+            const ReadWriteLock::version_t tree_version = rw_lock.read_begin();
+            const Node* node = root;
+            ReadWriteLock::version_t version = node ? node->rw_lock.read_begin() : 0;
+            if (rw_lock.read_validate(tree_version)) {
+                if (!node) return 0;
+                while (true) {
+                    const bool found = begin==node->begin && end==node->end;
+                    const size_t multip = node->multip;
+                    const Node* next = interval_less(node->begin, node->end, begin, end) ? node->right : node->left;
+                    const ReadWriteLock::version_t next_version = next ? next->rw_lock.read_begin() : 0;
+                    if (!node->rw_lock.read_validate(version)) break;
+                    if (found) return multip;
+                    if (!next) return 0;
+                    node = next;
+                    version = next_version;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
 
-        // Does not maintain the max value of a node (that requires a rebalance)
-        // Will write locke the entire subtree under the removed element.
-        
-        if (node->is_null) {
-            node->rw_lock.unlock_write();
-            if (is_root) rw_lock.unlock_write();
-            return;
+    // Lock-free read path, counts the intervals overlapping [a,b), or [a,b] when closed (a==b is a stabbing query).
+    // Follows the same rules as node_visit, but validates node versions instead of locking, and restarts
+    // from the root when a writer changed something on the way.
+    // visited gets the number of nodes the successful pass looked at.
+    size_t node_count_optimistic(const P &a, const P &b, const bool closed, size_t *visited = nullptr) const {
+        tree_stats.add(STAT_QUERIES);
+        EpochDomain::Guard guard(epochs);
+        OptimisticReadScope scope;
+        TraversalStack<Versioned> stack;
+        while (true) {
+            const ReadWriteLock::version_t tree_version = rw_lock.read_begin();
+            const Node* node = root;
+            const ReadWriteLock::version_t version = node ? node->rw_lock.read_begin() : 0;
+            size_t count = 0, nodes = 0;
+            const bool valid = rw_lock.read_validate(tree_version) && node_count_optimistic(node, version, a, b, closed, count, nodes, stack);
+            tree_stats.add(STAT_VISITED, nodes);
+            if (valid) {
+                if (visited) *visited = nodes;
+                return count;
+            }
+            std::this_thread::yield();
         }
-        
-        if (begin <= node->begin) {
-            if (begin==node->begin && end==node->end) {
-                if (node->multip > 1) {
-                    node->multip -= 1;
-                    node->rw_lock.unlock_write();
-                    if (is_root) rw_lock.unlock_write();
-                    change = 0;
-                    return;
+    }
+
+    // A node still to look at, with the version read while its parent was unchanged.
+    struct Versioned {
+        const Node *node;
+        ReadWriteLock::version_t version;
+    };
+
+    bool node_count_optimistic(const Node *node, ReadWriteLock::version_t version, const P &a, const P &b, const bool closed, size_t &count, size_t &visited,
+                               TraversalStack<Versioned> &stack) const {
+        // Returns false if the snapshot of a node got invalidated, the stack is left empty.
+        // The caller pins the epoch, so nodes unlinked meanwhile are not freed and can still be read and validated.
+        // A missing child was read from a validated parent, there is nothing to check.
+        // Goes down the left links, the stack holds the right subtrees still to count.
+        while (true) {
+            while (node) {
+                ++visited;
+                const ReadWriteLock &lock = node->rw_lock;
+                if (!all_less(a, node->max)) {
+                    if (lock.read_validate(version)) break;
+                    stack.clear();
+                    return false;
                 }
-                node->left->rw_lock.lock_write();
-                change = -1;
-                if (!node->left->is_null) {
-                    Node *up = node_remove_rightmost(node);
-                    node->begin = up->begin;
-                    node->end = up->end;
-                    node->multip = up->multip;
-                    delete up;
-                    node->rw_lock.unlock_write();
-                    if (is_root) rw_lock.unlock_write();
-                    return;
-                } 
-                else {
-                    node->right->rw_lock.lock_write();
-                    node->left->rw_lock.unlock_write();
-                    if (!node->right->is_null) {
-                        Node *up = node_remove_leftmost(node);
-                        node->begin = up->begin;
-                        node->end = up->end;
-                        node->multip = up->multip;
-                        delete up;
-                        node->rw_lock.unlock_write();
-                        if (is_root) rw_lock.unlock_write();
-                        return;
-                    } 
-                    else {
-                        node->is_null = true;
-                        node->left->rw_lock.lock_write();
-                        delete node->left;
-                        delete node->right;
-                        node->rw_lock.unlock_write();
-                        if (is_root) rw_lock.unlock_write();
-                        return;
-                    }
+                const bool go_right = closed ? !(b[0] < node->begin[0]) : node->begin[0] < b[0];
+                const bool hit = go_right && box_overlaps(node->begin, node->end, a, b, closed);
+                const size_t multip = node->multip;
+                const Node* left = node->left;
+                const Node* right = go_right ? node->right : nullptr;
+                if (!lock.read_validate(version)) {
+                    stack.clear();
+                    return false;
                 }
-            } 
-            else {
-                node->left->rw_lock.lock_write();
-                Node* left = node->left;
-                node->rw_lock.unlock_write();
-                if (is_root) rw_lock.unlock_write();
-                node_remove(left, begin, end, change);
-                return;
+
+                // Children versions are taken while node is unchanged, like locking them before unlocking node.
+                const ReadWriteLock::version_t left_version = left ? left->rw_lock.read_begin() : 0;
+                const ReadWriteLock::version_t right_version = right ? right->rw_lock.read_begin() : 0;
+                if (!lock.read_validate(version)) {
+                    stack.clear();
+                    return false;
+                }
+
+                if (hit) count += multip;
+                if (right) stack.push({right, right_version});
+                node = left;
+                version = left_version;
             }
-        } 
-        else {
-            node->right->rw_lock.lock_write();
-            Node* right = node->right;
-            node->rw_lock.unlock_write();
-            if (is_root) rw_lock.unlock_write();
-            node_remove(right, begin, end, change);
-            return;
+            if (stack.empty()) return true;
+            const Versioned top = stack.pop();
+            node = top.node;
+            version = top.version;
         }
     }
 
-    size_t node_query(const P &p) const {
-        rw_lock.lock_read();
-        root->rw_lock.lock_read();
-        return node_query(root, p, true);
+    template <class OutputIt>
+    OutputIt write_intervals(const P &a, const P &b, const bool closed, OutputIt out) const {
+        auto f = [&out](const P &begin, const P &end, const size_t multip) {
+            for (size_t i = 0; i < multip; ++i) *out++ = I(begin, end);
+        };
+        node_visit(a, b, closed, f);
+        return out;
     }
 
-    size_t node_query(const Node *node, const P &p, const bool is_root = false) const {
+    template <class F>
+    void node_visit(const P &a, const P &b, const bool closed, F &f) const {
+        StatsScope scope(tree_stats);
+        tree_stats.add(STAT_QUERIES);
+        if (const Node *node = lock_root(false)) node_visit(node, a, b, closed, f);
+    }
+
+    // Visits the intervals overlapping [a,b), or [a,b] when closed (a==b is a stabbing query).
+    template <class F>
+    void node_visit(const Node *node, const P &a, const P &b, const bool closed, F &f) const {
         // node must already be read locked!
-        // Before return, node must be read unlocked!
-        if (node->is_null) {
-            node->rw_lock.unlock_read();
-            if (is_root) rw_lock.unlock_read();
-            return 0;
-        }
-
-        if (p < node->begin) {
-            // Locking child first, then unlocking current node
-            Node* left = node->left;
-            left->rw_lock.lock_read();
-            node->rw_lock.unlock_read();
-            if (is_root) rw_lock.unlock_read();
-            return node_query(left, p);
-        } 
-        else if (p < node->max) {
-            size_t subquery = p < node->end ? node->multip : 0;
-            // Locking both children for subquery, then unlocking current node
-            Node* left = node->left;
-            Node* right = node->right;
-            left->rw_lock.lock_read();
-            right->rw_lock.lock_read();
-            node->rw_lock.unlock_read();
-            if (is_root) rw_lock.unlock_read();
-            subquery += node_query(left, p);
-            subquery += node_query(right, p);
-            return subquery;
+        // Before return, every node is read unlocked!
+        // The stack holds the read locked nodes whose visit is still to come.
+        TraversalStack<const Node*> stack;
+        while (true) {
+            tree_stats.add(STAT_VISITED);
+            if (!all_less(a, node->max)) {
+                node->rw_lock.unlock_read();
+            }
+            else {
+                // Locking children first, then unlocking current node
+                Node* left = node->left;
+                if (left) left->rw_lock.lock_read();
+                if (closed ? !(b[0] < node->begin[0]) : node->begin[0] < b[0]) {
+                    if (box_overlaps(node->begin, node->end, a, b, closed)) f(node->begin, node->end, node->multip);
+                    Node* right = node->right;
+                    if (right) right->rw_lock.lock_read();
+                    if (right) stack.push(right);
+                }
+                node->rw_lock.unlock_read();
+                if (left) stack.push(left);
+            }
+            if (stack.empty()) return;
+            node = stack.pop();
         }
-        else {
-            node->rw_lock.unlock_read();
-            if (is_root) rw_lock.unlock_read();
-            return 0;
+    }
+
+    // Walk of the read locked path of node_visit_all and node_shape: stage 0 goes left, 1 goes right, 2 unlocks.
+    struct PathFrame {
+        const Node *node;
+        size_t depth;
+        int stage;
+    };
+
+    // Writers only move downwards, so read locking top-down and holding the path waits out
+    // every writer below, none can pass.
+    template <class F>
+    // node must already be read locked, it is unlocked on return.
+    void node_visit_all(const Node *node, F &f) const {
+        TraversalStack<PathFrame> path;
+        path.push({node, 0, 0});
+        while (!path.empty()) {
+            PathFrame &top = path.top();
+            const Node *current = top.node;
+            const int stage = top.stage++;
+            const Node *child = nullptr;
+            if (stage == 0) {
+                child = current->left;
+            }
+            else if (stage == 1) {
+                f(current->begin, current->end, current->multip);
+                child = current->right;
+            }
+            else {
+                path.pop();
+                current->rw_lock.unlock_read();
+            }
+            if (child) {
+                child->rw_lock.lock_read();
+                path.push({child, 0, 0});
+            }
         }
     }
 
-    Node *node_remove_leftmost(Node* deleted_node) {
-        // deleted_node and deleted_node->right must be locked;
-        // After return deleted_node is still locked, deleted_node->right is unlocked 
-        // the returned node is locked, but its children (the null nodes) are not locked.
-        Node* child = deleted_node->right;
-        child->left->rw_lock.lock_write();
-        if (child->left->is_null) {
-            child->left->rw_lock.unlock_write();
-            deleted_node->right = new Node();
-            return child;
+    // node must already be read locked, it is unlocked on return.
+    void node_shape(const Node *node, const size_t depth, TreeStatsSnapshot &snapshot) const {
+        TraversalStack<PathFrame> path;
+        path.push({node, depth, 0});
+        while (!path.empty()) {
+            PathFrame &top = path.top();
+            const Node *current = top.node;
+            const size_t current_depth = top.depth;
+            const int stage = top.stage++;
+            if (stage == 0) {
+                ++snapshot.nodes;
+                snapshot.height = std::max(snapshot.height, current_depth);
+            }
+            if (stage == 2) {
+                path.pop();
+                current->rw_lock.unlock_read();
+                continue;
+            }
+            const Node *child = stage == 0 ? current->left : current->right;
+            if (child) {
+                child->rw_lock.lock_read();
+                path.push({child, current_depth + 1, 0});
+            }
+            else ++snapshot.null_nodes;
         }
-        else {
-            return node_remove_leftmost(child, child->left);
+    }
+
+    // Recomputes the max and low of the nodes a remove went through, bottom-up, so the pruning of queries
+    // and of prune_before stays tight. They are still write locked, top-down on the way to the removed interval:
+    // a child of a node is either the next one or read locked meanwhile, in the order writers lock.
+    void repair_max(const std::vector<Node*> &path) {
+        const Node *below = nullptr;
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            Node *node = *it, *left = node->left, *right = node->right;
+            if (left && left != below) left->rw_lock.lock_read();
+            if (right && right != below) right->rw_lock.lock_read();
+            node_repair(node);
+            if (left && left != below) left->rw_lock.unlock_read();
+            if (right && right != below) right->rw_lock.unlock_read();
+            below = node;
         }
     }
-    Node *node_remove_leftmost(Node* parent, Node* child) {
-        // parent and child must be locked, but after return they are unlocked,
-        // the returned node is locked (but its children, the null nodes are not)
 
-        child->left->rw_lock.lock_write();
-        while (!child->left->is_null) {
-            parent->rw_lock.unlock_write();
-            parent = child;
-            child = child->left;
-            child->left->rw_lock.lock_write();
+    // Recomputes max and low of a write locked node from its children, that must be locked too.
+    // Optimistic readers are only failed if they change.
+    static void node_repair(Node *node) {
+        P max = node->max;
+        T low = node->low;
+        const bool max_changed = assign_max(max, node->end, node->left ? &node->left->max : nullptr, node->right ? &node->right->max : nullptr);
+        const bool low_changed = assign_low(low, node->end, node->left ? &node->left->low : nullptr, node->right ? &node->right->low : nullptr);
+        if (max_changed || low_changed) {
+            node->rw_lock.begin_write();
+            node->max = max;
+            node->low = low;
         }
+    }
 
-        parent->left = new Node();
-        parent->rw_lock.unlock_write();
-        child->left->rw_lock.unlock_write();
-        return child;
+    // The nodes on the way to a pruned subtree stay locked until its weight is known, it moves out of their
+    // subtrees.
+    void unlock_path(std::vector<Node*> &path, const size_t weight) {
+        for (Node *node : path) {
+            node->size.fetch_sub(weight, std::memory_order_relaxed);
+            node->rw_lock.unlock_write();
+        }
     }
 
     Node *node_remove_rightmost(Node* deleted_node) {
         // deleted_node and deleted_node->left must be locked;
-        // After return deleted_node is still locked, deleted_node->left is unlocked 
-        // the returned node is locked, but its children (the null nodes) are not locked.
+        // After return deleted_node is still locked, the rest of the path is repaired and unlocked,
+        // the returned node is locked and unlinked, its left subtree is moved up to its parent.
+        Node* parent = deleted_node;
         Node* child = deleted_node->left;
-        child->right->rw_lock.lock_write();
-        if (child->right->is_null) {
-            child->right->rw_lock.unlock_write();
-            deleted_node->left = new Node();
-            return child;
-        }
-        else {
-            return node_remove_rightmost(child, child->right);
-        }
-    }
-    Node *node_remove_rightmost(Node* parent, Node* child) {
-        // parent and child must be locked, but after return they are unlocked,
-        // the returned node is locked (but its children, the null nodes are not)
-
-        child->right->rw_lock.lock_write();
-        while (!child->right->is_null) {
-            parent->rw_lock.unlock_write();
+        std::vector<Node*> path;
+        while (child->right) {
+            child->right->rw_lock.lock_write();
+            path.push_back(child);
             parent = child;
             child = child->right;
-            child->right->rw_lock.lock_write();
         }
 
-        parent->right = new Node();
-        parent->rw_lock.unlock_write();
-        child->right->rw_lock.unlock_write();
+        parent->rw_lock.begin_write();
+        if (parent == deleted_node) parent->left = child->left;
+        else parent->right = child->left;
+        // The weights on the path are recomputed, not decreased by child->multip: one a remove left short for an
+        // interval it did not find between the two keys is off the way to that interval now, deleted_node is not.
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            Node *node = *it, *other = node == parent ? node->right : nullptr;
+            if (node->left) node->left->rw_lock.lock_read();
+            if (other) other->rw_lock.lock_read();
+            node->size.store(weight(node->left) + weight(node->right) - 2 + node->multip, std::memory_order_relaxed);
+            node_repair(node);
+            if (node->left) node->left->rw_lock.unlock_read();
+            if (other) other->rw_lock.unlock_read();
+            node->rw_lock.unlock_write();
+        }
+        child->rw_lock.begin_write();
+        child->left = nullptr;
         return child;
     }
 
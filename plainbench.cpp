@@ -1,4 +1,6 @@
 #include <cstddef>
+#include <atomic>
+#include <tuple>
 #include <random>
 #include <thread>
 #include <vector>
@@ -10,6 +12,12 @@
 #include "datagen.hpp"
 
 
+#if defined(__SANITIZE_THREAD__)
+// Built by `make plainbench-tsan`. The lock order detector is off: build and clear hold every node lock,
+// and rotations change which node is the parent, so hand-over-hand lock order depends on the tree shape.
+extern "C" const char* __tsan_default_options() { return "history_size=7 detect_deadlocks=0"; }
+#endif
+
 
 // DATA GENERATION
 typedef int TYP;
@@ -18,36 +26,106 @@ Data<TYP>       DAT_INSERT_REMOVE(1E4, 0, 100, 1, 0,   0.7,  0.25, 0.05);
 Data<TYP> DAT_INSERT_QUERY_REMOVE(1E4, 0, 100, 1, 0.8, 0.15, 0.04, 0.01);
 Data<TYP>               DAT_QUERY(1E4, 0, 100, 1, 1,   0,    0,    0);
 
-void threadFunc(ParallelIntervalTree<TYP> &pt, const Data<TYP>& DAT, const size_t offset, const size_t step) {
+// Queries that fall outside what a reference allows, see threadFunc.
+std::atomic<size_t> bad_queries(0);
+
+// Every query result must lie between what the reference trees give: the same tree before and after
+// the phase, writers only remove meanwhile, so a count can only go down from one to the other.
+void threadFunc(ParallelIntervalTree<TYP> &pt, const Data<TYP>& DAT, const size_t offset, const size_t step,
+                const IntervalTree<TYP> &before, const IntervalTree<TYP> &after) {
     for (size_t i = offset; i < DAT.tsks.size(); i += step) {
         auto& tsk = DAT.tsks[i];
         if (i%1000 == 0) std::cout << i << std::endl;
         switch (tsk.method) {
-        case DAT.QUERY:
-            pt.query(tsk.a);
+        case DAT.QUERY: {
+            const size_t count = pt.query(tsk.a);
+            if (count < after.query(tsk.a) || before.query(tsk.a) < count) ++bad_queries;
             break;
+        }
         case DAT.INSERT:
             pt.insert(tsk.a, tsk.b);
             break;
         case DAT.REMOVE:
             pt.remove(tsk.a, tsk.b);
             break;
+        default:
+            break;
         }
     }
 }
 
+template <class Tree>
+std::vector<std::tuple<TYP, TYP, size_t>> contents(const Tree &t) {
+    std::vector<std::tuple<TYP, TYP, size_t>> all;
+    t.visit_all([&all](const auto &begin, const auto &end, const size_t multip) { all.emplace_back(begin[0], end[0], multip); });
+    return all;
+}
+
+// The tree must hold what the tasks applied one by one leave, and be a valid tree.
+bool check(const ParallelIntervalTree<TYP> &pt, const IntervalTree<TYP> &reference, const char *phase) {
+    const bool ok = bad_queries == 0 && contents(pt) == contents(reference) && pt.valid();
+    std::cout << phase << (ok ? " ok" : " FAILED") << ", bad queries " << bad_queries << std::endl;
+    return ok;
+}
 
 
 int main() {
     ParallelIntervalTree<TYP> pt;
-    threadFunc(pt, DAT_INSERT, 0, 1);
-    std::thread th1(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 0, 4);
-    std::thread th2(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 1, 4);
-    std::thread th3(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 2, 4);
-    std::thread th4(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 3, 4);
+    IntervalTree<TYP> inserted;
+    for (auto& tsk : DAT_INSERT.tsks) inserted.insert(tsk.a, tsk.b);
+    threadFunc(pt, DAT_INSERT, 0, 1, inserted, inserted);
+    std::thread th1(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 0, 4, std::cref(inserted), std::cref(inserted));
+    std::thread th2(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 1, 4, std::cref(inserted), std::cref(inserted));
+    std::thread th3(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 2, 4, std::cref(inserted), std::cref(inserted));
+    std::thread th4(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 3, 4, std::cref(inserted), std::cref(inserted));
     th1.join();
     th2.join();
     th3.join();
     th4.join();
-}
+    if (!check(pt, inserted, "queries")) return 1;
+
+    // Remove every other interval while querying, unlinked nodes go through epoch based reclamation.
+    Data<TYP> DAT_REMOVE = DAT_INSERT;
+    IntervalTree<TYP> left;
+    for (size_t i = 0; i < DAT_REMOVE.tsks.size(); ++i) {
+        auto& tsk = DAT_REMOVE.tsks[i];
+        tsk.method = i % 2 == 0 ? DAT_REMOVE.REMOVE : DAT_REMOVE.NOOP;
+        if (i % 2 == 1) left.insert(tsk.a, tsk.b);
+    }
+    std::thread rm1(threadFunc, std::ref(pt), std::ref(DAT_REMOVE), 0, 2, std::cref(inserted), std::cref(left));
+    std::thread rm2(threadFunc, std::ref(pt), std::ref(DAT_REMOVE), 1, 2, std::cref(inserted), std::cref(left));
+    std::thread qr1(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 0, 2, std::cref(inserted), std::cref(left));
+    std::thread qr2(threadFunc, std::ref(pt), std::ref(DAT_QUERY), 1, 2, std::cref(inserted), std::cref(left));
+    rm1.join();
+    rm2.join();
+    qr1.join();
+    qr2.join();
+    if (!check(pt, left, "removes")) return 1;
 
+    // Put the removed intervals back and take out the others while pruning, then prune once more with no writer left:
+    // what the tasks leave that does not end before the watermark must stay, with exact weights.
+    const Point<TYP> watermark(50);
+    Data<TYP> DAT_SWAP = DAT_INSERT;
+    IntervalTree<TYP> kept;
+    for (size_t i = 0; i < DAT_SWAP.tsks.size(); ++i) {
+        auto& tsk = DAT_SWAP.tsks[i];
+        tsk.method = i % 2 == 0 ? DAT_SWAP.INSERT : DAT_SWAP.REMOVE;
+        if (i % 2 == 0 && !all_less(tsk.b, watermark)) kept.insert(tsk.a, tsk.b);
+    }
+    std::atomic<bool> swapping(true);
+    std::thread sw1(threadFunc, std::ref(pt), std::ref(DAT_SWAP), 0, 2, std::cref(kept), std::cref(kept));
+    std::thread sw2(threadFunc, std::ref(pt), std::ref(DAT_SWAP), 1, 2, std::cref(kept), std::cref(kept));
+    std::thread pr([&pt, &watermark, &swapping] {
+        while (swapping) pt.prune_before(watermark);
+    });
+    sw1.join();
+    sw2.join();
+    swapping = false;
+    pr.join();
+    pt.prune_before(watermark);
+    if (!check(pt, kept, "prunes")) return 1;
+    std::cout << "retired " << pt.retired_nodes() << ", reclaimed " << pt.reclaimed_nodes() << std::endl;
+#ifdef PIT_STATS
+    std::cout << pt.stats().json() << std::endl;
+#endif
+}
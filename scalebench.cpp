@@ -0,0 +1,276 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "it.hpp"
+#include "pit.hpp"
+#include "persistent.hpp"
+#include "cit.hpp"
+#include "harness.hpp"
+#include "trace.hpp"
+
+
+// Throughput and tail latency sweep: every combination of tree size, thread count and workload runs on
+// a freshly built tree, with persistent workers started from a barrier (see WorkerPool). Each operation
+// is timed on its own, per-thread histograms are merged into p50/p99/p999 per method.
+// Results go out as JSON, a table is printed to stderr as the sweep goes.
+//
+// With -r a recorded trace (see trace.hpp) is replayed on an empty tree instead, at each thread count.
+//
+//   scalebench.out [-T tree] [-s sizes] [-t threads] [-w workloads] [-n ops] [-r trace] [-o file]
+//
+//   -T  pit (default), pit_slab, cit, pst, or it (single threaded, other thread counts are skipped)
+//   -s  tree sizes, default 1e3,1e4,1e5,1e6. Up to 1e8 fits in about 16GB.
+//   -t  thread counts, default 1,2,4,... up to the number of cores
+//   -w  workloads, default read_mostly,balanced,write_heavy,query_only
+//   -n  operations per thread and run, default 1e5
+//   -r  trace file of int 1D intervals to replay, -s, -w and -n are ignored
+//   -o  JSON output file, default stdout
+
+typedef int TYP;
+typedef Point<TYP, 1> P;
+typedef Interval<TYP, 1> I;
+
+// Shares of queries, inserts and removes. Inserts and removes are balanced so the size holds.
+struct Workload {
+    std::string name;
+    double query, insert, remove;
+};
+const std::vector<Workload> WORKLOADS = {
+    {"read_mostly", 0.90, 0.05, 0.05},
+    {"balanced",    0.50, 0.25, 0.25},
+    {"write_heavy", 0.10, 0.45, 0.45},
+    {"query_only",  1.00, 0.00, 0.00},
+};
+
+// Intervals start anywhere in [0, 10*size) and are 1-100 long, a point is covered by about 5 of them.
+struct KeySpace {
+    explicit KeySpace(const size_t size) : begin(0, static_cast<TYP>(std::max<size_t>(10 * size, 100))), length(1, 100) {}
+    template <class Gen>
+    I interval(Gen &gen) {
+        const TYP b = begin(gen);
+        return I(P(b), P(b + length(gen)));
+    }
+    template <class Gen>
+    P point(Gen &gen) { return P(begin(gen)); }
+
+    std::uniform_int_distribution<TYP> begin, length;
+};
+
+// The operations of one thread, generated before the run. Removes take the oldest interval the thread
+// inserted, or one of the initial intervals dealt to it.
+std::vector<Task<TYP, 1>> generate_ops(const Workload &w, const std::vector<I> &initial, const size_t thread, const size_t threads, const size_t n) {
+    std::mt19937 gen(static_cast<uint32_t>(1 + thread));
+    KeySpace keys(initial.size());
+    std::uniform_real_distribution<double> pick(0.0, 1.0);
+    std::deque<I> own;
+    size_t dealt = thread;
+    std::vector<Task<TYP, 1>> ops(n);
+    for (Task<TYP, 1> &op : ops) {
+        const double r = pick(gen);
+        if (r < w.query) {
+            op.method = op.QUERY;
+            op.a = keys.point(gen);
+        } else if (r < w.query + w.insert) {
+            const I iv = keys.interval(gen);
+            op.method = op.INSERT;
+            op.a = iv.begin;
+            op.b = iv.end;
+            own.push_back(iv);
+        } else if (!own.empty() || dealt < initial.size()) {
+            const I iv = own.empty() ? initial[dealt] : own.front();
+            if (own.empty()) dealt += threads;
+            else own.pop_front();
+            op.method = op.REMOVE;
+            op.a = iv.begin;
+            op.b = iv.end;
+        }
+    }
+    return ops;
+}
+
+struct RunResult {
+    double seconds = 0;
+    size_t ops = 0;
+    LatencyHistogram latency[3];
+};
+
+template <class Tree>
+RunResult run(const std::vector<I> &initial, const Workload &w, WorkerPool &pool, const size_t ops_per_thread) {
+    const size_t threads = pool.size();
+    std::vector<std::vector<Task<TYP, 1>>> ops(threads);
+    for (size_t t = 0; t < threads; ++t) ops[t] = generate_ops(w, initial, t, threads, ops_per_thread);
+    Tree tree;
+    tree.build(initial.begin(), initial.end());
+
+    std::vector<RunResult> per_thread(threads);
+    RunResult result;
+    result.seconds = pool.run([&](const size_t t) {
+        RunResult &mine = per_thread[t];
+        size_t sink = 0;
+        for (const Task<TYP, 1> &op : ops[t]) {
+            if (op.method == op.NOOP) continue;
+            const auto start = std::chrono::steady_clock::now();
+            switch (op.method) {
+            case op.QUERY:
+                sink += tree.query(op.a);
+                break;
+            case op.INSERT:
+                tree.insert(op.a, op.b);
+                break;
+            case op.REMOVE:
+                tree.remove(op.a, op.b);
+                break;
+            default:
+                break;
+            }
+            const auto stop = std::chrono::steady_clock::now();
+            mine.latency[op.method].record(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+        }
+        mine.ops = sink;
+    });
+    for (const RunResult &mine : per_thread) {
+        for (int m = 0; m < 3; ++m) result.latency[m].merge(mine.latency[m]);
+    }
+    for (int m = 0; m < 3; ++m) result.ops += result.latency[m].count();
+    return result;
+}
+
+// The calls recorded by thread t run on worker t % threads, in their recorded order.
+template <class Tree>
+RunResult run_trace(const MappedTrace<TYP, 1> &trace, WorkerPool &pool) {
+    Tree tree;
+    std::vector<RunResult> per_thread(pool.size());
+    RunResult result;
+    result.seconds = trace.dispatch(pool, [&](const size_t worker, const size_t i) {
+        const auto start = std::chrono::steady_clock::now();
+        trace.apply(tree, i);
+        const auto stop = std::chrono::steady_clock::now();
+        per_thread[worker].latency[trace.method(i)].record(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+    });
+    for (const RunResult &mine : per_thread) {
+        for (int m = 0; m < 3; ++m) result.latency[m].merge(mine.latency[m]);
+    }
+    for (int m = 0; m < 3; ++m) result.ops += result.latency[m].count();
+    return result;
+}
+
+// "1e5", "100000" and "1E5" all parse.
+std::vector<size_t> parse_list(const std::string &text) {
+    std::vector<size_t> values;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) values.push_back(static_cast<size_t>(std::stod(item)));
+    return values;
+}
+
+int main(int argc, char **argv) {
+    std::string tree_kind = "pit", out_file, trace_file;
+    std::vector<size_t> sizes = {1000, 10000, 100000, 1000000};
+    std::vector<size_t> thread_counts;
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t t = 1; t < cores; t *= 2) thread_counts.push_back(t);
+    thread_counts.push_back(cores);
+    std::vector<Workload> workloads = WORKLOADS;
+    size_t ops_per_thread = 100000;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string flag = argv[i], value = argv[i + 1];
+        if (flag == "-T") tree_kind = value;
+        else if (flag == "-s") sizes = parse_list(value);
+        else if (flag == "-t") thread_counts = parse_list(value);
+        else if (flag == "-n") ops_per_thread = parse_list(value).at(0);
+        else if (flag == "-o") out_file = value;
+        else if (flag == "-r") trace_file = value;
+        else if (flag == "-w") {
+            workloads.clear();
+            std::stringstream in(value);
+            std::string name;
+            while (std::getline(in, name, ',')) {
+                for (const Workload &w : WORKLOADS) if (w.name == name) workloads.push_back(w);
+            }
+        }
+        else {
+            std::cerr << "unknown flag " << flag << std::endl;
+            return 1;
+        }
+    }
+
+    auto run_tree = [&](const std::vector<I> &initial, const Workload &w, WorkerPool &pool) {
+        if (tree_kind == "pit_slab") return run<ParallelIntervalTree<TYP, 1, SlabAllocator>>(initial, w, pool, ops_per_thread);
+        if (tree_kind == "cit") return run<CombiningIntervalTree<TYP, 1>>(initial, w, pool, ops_per_thread);
+        if (tree_kind == "pst") return run<PersistentIntervalTree<TYP, 1>>(initial, w, pool, ops_per_thread);
+        if (tree_kind == "it") return run<IntervalTree<TYP, 1>>(initial, w, pool, ops_per_thread);
+        return run<ParallelIntervalTree<TYP, 1>>(initial, w, pool, ops_per_thread);
+    };
+
+    const char *methods[] = {"query", "insert", "remove"};
+    std::ostringstream json;
+    json << "{\"tree\":\"" << tree_kind << "\",\"cores\":" << cores << ",\"ops_per_thread\":" << ops_per_thread << ",\"results\":[";
+    bool first = true;
+    std::cerr << "size\tthreads\t workload\tops/s\tquery p50/p99/p999 ns\tinsert\tremove" << std::endl;
+    auto report = [&](const size_t size, const size_t threads, const std::string &workload, const RunResult &r) {
+        const double ops_per_sec = r.ops / r.seconds;
+
+        std::cerr << size << "\t" << threads << "\t " << workload << "\t" << static_cast<size_t>(ops_per_sec);
+        for (int m = 0; m < 3; ++m) {
+            std::cerr << "\t" << r.latency[m].percentile(0.5) << "/" << r.latency[m].percentile(0.99) << "/" << r.latency[m].percentile(0.999);
+        }
+        std::cerr << std::endl;
+
+        json << (first ? "" : ",") << "{\"size\":" << size << ",\"threads\":" << threads << ",\"workload\":\"" << workload
+             << "\",\"ops\":" << r.ops << ",\"seconds\":" << r.seconds << ",\"ops_per_sec\":" << ops_per_sec << ",\"latency_ns\":{";
+        for (int m = 0; m < 3; ++m) json << (m ? "," : "") << "\"" << methods[m] << "\":" << r.latency[m].json();
+        json << "}}";
+        first = false;
+    };
+
+    if (!trace_file.empty()) {
+        MappedTrace<TYP, 1> trace;
+        if (!trace.open(trace_file)) {
+            std::cerr << "can't replay " << trace_file << ": missing, truncated, or not a trace of int 1D intervals" << std::endl;
+            return 1;
+        }
+        for (const size_t threads : thread_counts) {
+            if (tree_kind == "it" && threads != 1) continue;
+            WorkerPool pool(threads);
+            RunResult r;
+            if (tree_kind == "pit_slab") r = run_trace<ParallelIntervalTree<TYP, 1, SlabAllocator>>(trace, pool);
+            else if (tree_kind == "cit") r = run_trace<CombiningIntervalTree<TYP, 1>>(trace, pool);
+            else if (tree_kind == "pst") r = run_trace<PersistentIntervalTree<TYP, 1>>(trace, pool);
+            else if (tree_kind == "it") r = run_trace<IntervalTree<TYP, 1>>(trace, pool);
+            else r = run_trace<ParallelIntervalTree<TYP, 1>>(trace, pool);
+            report(trace.size(), threads, "trace", r);
+        }
+    }
+    for (const size_t size : trace_file.empty() ? sizes : std::vector<size_t>()) {
+        std::mt19937 gen(0);
+        KeySpace keys(size);
+        std::vector<I> initial;
+        initial.reserve(size);
+        for (size_t i = 0; i < size; ++i) initial.push_back(keys.interval(gen));
+
+        for (const size_t threads : thread_counts) {
+            if (tree_kind == "it" && threads != 1) continue;
+            WorkerPool pool(threads);
+            for (const Workload &w : workloads) report(size, threads, w.name, run_tree(initial, w, pool));
+        }
+    }
+    json << "]}";
+
+    if (out_file.empty()) {
+        std::cout << json.str() << std::endl;
+    } else {
+        std::ofstream out(out_file);
+        out << json.str() << std::endl;
+    }
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+#include "pit.hpp"
+
+
+// Range partitioned front-end over independent ParallelIntervalTrees. The key space is cut on begin[0]
+// at the shard bounds, shard i holds the intervals with bounds[i-1] <= begin[0] < bounds[i] that also end
+// before bounds[i]. Intervals crossing the upper bound of their shard go to one spanning tree. A stabbing
+// query at p only asks the shard of p[0] and the spanning tree, an overlap query the shards its range meets.
+// Writers to different shards share no lock, the roots of the shard trees are not a common bottleneck.
+template <typename T, size_t D = DYNAMIC_DIM, class Alloc = HeapAllocator>
+class ShardedIntervalTree {
+public:
+    typedef T value_t;
+    typedef Point<T, D> P;
+    typedef Interval<T, D> I;
+    typedef ParallelIntervalTree<T, D, Alloc> Tree;
+
+    // bounds must be sorted, there is one shard more than bounds.
+    explicit ShardedIntervalTree(const std::vector<T> &bounds) : bounds(bounds), loads(bounds.size() + 1) {
+        for (size_t i = 0; i <= bounds.size(); ++i) shards.emplace_back(new Tree());
+    }
+    // count shards of equal width over [lo, hi)
+    ShardedIntervalTree(const size_t count, const T &lo, const T &hi) : ShardedIntervalTree(even_bounds(count, lo, hi)) {}
+
+    void insert(const I &interval) { insert(interval.begin, interval.end); }
+    void insert(const P &begin, const P &end) {
+        SharedGuard guard(*this);
+        tree_of(begin, end).insert(begin, end);
+    }
+
+    void remove(const I &interval) { remove(interval.begin, interval.end); }
+    void remove(const P &begin, const P &end) {
+        SharedGuard guard(*this);
+        tree_of(begin, end).remove(begin, end);
+    }
+
+    // Removes every interval ending before watermark, see ParallelIntervalTree::prune_before. Shards above the
+    // one of watermark[0] are skipped, their intervals begin, and so end, at watermark[0] or later.
+    size_t prune_before(const P &watermark) {
+        SharedGuard guard(*this);
+        size_t pruned = spanning.prune_before(watermark);
+        for (size_t i = 0; i <= shard_of(watermark[0]); ++i) pruned += shards[i]->prune_before(watermark);
+        return pruned;
+    }
+
+    // Replaces the contents with the intervals of [first, last), every shard is built in one pass.
+    template <class InputIt>
+    void build(InputIt first, InputIt last) {
+        ExclusiveGuard guard(*this);
+        distribute(std::vector<I>(first, last));
+    }
+
+    size_t query(const P &p) const {
+        SharedGuard guard(*this);
+        const size_t i = shard_of(p[0]);
+        loads[i].count.fetch_add(1, std::memory_order_relaxed);
+        return shards[i]->query(p) + spanning.query(p);
+    }
+
+    // Intervals containing p, or overlapping [begin,end). An interval stored with
+    // multiplicity k is written k times, the visitor gets f(begin, end, multip) once.
+    template <class OutputIt>
+    OutputIt query(const P &p, OutputIt out) const {
+        SharedGuard guard(*this);
+        out = shards[shard_of(p[0])]->query(p, out);
+        return spanning.query(p, out);
+    }
+    template <class F>
+    void visit(const P &p, F f) const {
+        SharedGuard guard(*this);
+        shards[shard_of(p[0])]->visit(p, f);
+        spanning.visit(p, f);
+    }
+
+    template <class OutputIt>
+    OutputIt query_overlap(const P &begin, const P &end, OutputIt out) const {
+        SharedGuard guard(*this);
+        for (size_t i = shard_of(begin[0]); i <= shard_of(end[0]); ++i) out = shards[i]->query_overlap(begin, end, out);
+        return spanning.query_overlap(begin, end, out);
+    }
+    template <class F>
+    void visit_overlap(const P &begin, const P &end, F f) const {
+        SharedGuard guard(*this);
+        for (size_t i = shard_of(begin[0]); i <= shard_of(end[0]); ++i) shards[i]->visit_overlap(begin, end, f);
+        spanning.visit_overlap(begin, end, f);
+    }
+    size_t count_overlap(const P &begin, const P &end) const {
+        SharedGuard guard(*this);
+        size_t count = spanning.count_overlap(begin, end);
+        for (size_t i = shard_of(begin[0]); i <= shard_of(end[0]); ++i) count += shards[i]->count_overlap(begin, end);
+        return count;
+    }
+
+    // Every interval in key order, f(begin, end, multip), from a consistent snapshot of all shards.
+    template <class F>
+    void visit_all(F f) const {
+        ExclusiveGuard guard(*this);
+        std::vector<std::pair<I, size_t>> all = collect();
+        std::sort(all.begin(), all.end(), [](const auto &x, const auto &y) { return x.first < y.first; });
+        for (const auto &entry : all) f(entry.first.begin, entry.first.end, entry.second);
+    }
+
+    // Moves the shard bounds so that every shard gets about the same share of the operations seen since the
+    // last call, the load of a shard is spread evenly over its intervals. Operations wait meanwhile.
+    void rebalance() {
+        ExclusiveGuard guard(*this);
+        std::vector<size_t> ends;
+        std::vector<std::pair<I, size_t>> all = collect(&ends);
+        std::vector<double> weights;
+        weights.reserve(all.size());
+        double total = 0;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            const size_t count = ends[i] - (i > 0 ? ends[i - 1] : 0);
+            const size_t load = loads[i].count.exchange(0, std::memory_order_relaxed);
+            if (count > 0) {
+                weights.resize(ends[i], static_cast<double>(load) / count);
+                total += load;
+            }
+        }
+        // Spanning intervals come last and move with the new bounds, their load is not attributable to a shard.
+        weights.resize(all.size(), 0);
+        if (total == 0) {
+            std::fill(weights.begin(), weights.end(), 1.0);
+            total = static_cast<double>(all.size());
+        }
+
+        std::vector<size_t> order(all.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&all](const size_t x, const size_t y) { return all[x].first < all[y].first; });
+        double acc = 0;
+        size_t next = 0;
+        for (const size_t i : order) {
+            acc += weights[i];
+            while (next < bounds.size() && acc >= total * (next + 1) / shards.size()) {
+                const T &bound = all[i].first.begin[0];
+                bounds[next] = next > 0 ? std::max(bounds[next - 1], bound) : bound;
+                ++next;
+            }
+        }
+        for (; next > 0 && next < bounds.size(); ++next) bounds[next] = std::max(bounds[next - 1], bounds[next]);
+
+        std::vector<I> intervals;
+        for (const auto &entry : all) intervals.insert(intervals.end(), entry.second, entry.first);
+        distribute(std::move(intervals));
+    }
+
+    // Current shard bounds, and the operations each shard has seen since the last rebalance.
+    std::vector<T> shard_bounds() const {
+        SharedGuard guard(*this);
+        return bounds;
+    }
+    std::vector<size_t> shard_loads() const {
+        std::vector<size_t> counts;
+        for (const Load &load : loads) counts.push_back(load.count.load(std::memory_order_relaxed));
+        return counts;
+    }
+
+private:
+    static constexpr size_t STRIPES = 16;
+
+    // Operations share the stripe of their thread, rebalance and snapshots lock every stripe,
+    // so threads on different stripes never touch a common cache line.
+    struct alignas(64) Stripe {
+        mutable std::shared_mutex mtx;
+    };
+
+    struct alignas(64) Load {
+        mutable std::atomic<size_t> count{0};
+    };
+
+    struct SharedGuard {
+        explicit SharedGuard(const ShardedIntervalTree &tree) : stripe(tree.stripes[thread_index() % STRIPES]) { stripe.mtx.lock_shared(); }
+        ~SharedGuard() { stripe.mtx.unlock_shared(); }
+        const Stripe &stripe;
+    };
+
+    struct ExclusiveGuard {
+        explicit ExclusiveGuard(const ShardedIntervalTree &tree) : tree(tree) {
+            for (const Stripe &stripe : tree.stripes) stripe.mtx.lock();
+        }
+        ~ExclusiveGuard() {
+            for (const Stripe &stripe : tree.stripes) stripe.mtx.unlock();
+        }
+        const ShardedIntervalTree &tree;
+    };
+
+    static std::vector<T> even_bounds(const size_t count, const T &lo, const T &hi) {
+        std::vector<T> bounds;
+        for (size_t i = 1; i < count; ++i) bounds.push_back(static_cast<T>(lo + (hi - lo) * static_cast<double>(i) / count));
+        return bounds;
+    }
+
+    size_t shard_of(const T &x) const { return std::upper_bound(bounds.begin(), bounds.end(), x) - bounds.begin(); }
+
+    // The tree an interval is stored in, counting the operation to its shard.
+    Tree &tree_of(const P &begin, const P &end) {
+        const size_t i = shard_of(begin[0]);
+        if (i < bounds.size() && bounds[i] < end[0]) {
+            return spanning;
+        }
+        loads[i].count.fetch_add(1, std::memory_order_relaxed);
+        return *shards[i];
+    }
+
+    // Intervals of all shards, shard by shard in key order, then the spanning ones. ends gets the end
+    // of each shard in the result. All stripes must be locked.
+    std::vector<std::pair<I, size_t>> collect(std::vector<size_t> *ends = nullptr) const {
+        std::vector<std::pair<I, size_t>> all;
+        auto f = [&all](const P &begin, const P &end, const size_t multip) { all.emplace_back(I(begin, end), multip); };
+        for (const auto &shard : shards) {
+            shard->visit_all(f);
+            if (ends) ends->push_back(all.size());
+        }
+        spanning.visit_all(f);
+        return all;
+    }
+
+    // Rebuilds every tree from intervals under the current bounds. All stripes must be locked.
+    void distribute(std::vector<I> intervals) {
+        std::vector<std::vector<I>> parts(shards.size() + 1);
+        for (I &interval : intervals) {
+            const size_t i = shard_of(interval.begin[0]);
+            const bool spans = i < bounds.size() && bounds[i] < interval.end[0];
+            parts[spans ? shards.size() : i].push_back(std::move(interval));
+        }
+        for (size_t i = 0; i < shards.size(); ++i) shards[i]->build(parts[i].begin(), parts[i].end());
+        spanning.build(parts.back().begin(), parts.back().end());
+    }
+
+private:
+    Stripe stripes[STRIPES];
+    std::vector<T> bounds;
+    std::vector<std::unique_ptr<Tree>> shards;
+    Tree spanning;
+    std::vector<Load> loads;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIT_SIMD_X86 1
+#endif
+
+
+// Block kernels of the batched stabbing queries: a block of BLOCK points is compared against the
+// begin, end and max of one node at once. Bit i of a mask stands for points[i].
+namespace simd {
+
+constexpr size_t BLOCK = 64;
+typedef uint64_t mask_t;
+
+struct NodeMasks {
+    mask_t lt_begin, lt_end, lt_max;
+};
+
+template <typename T>
+NodeMasks compare_scalar(const T *points, const T &begin, const T &end, const T &max) {
+    NodeMasks m{0, 0, 0};
+    for (size_t i = 0; i < BLOCK; ++i) {
+        m.lt_begin |= mask_t(points[i] < begin) << i;
+        m.lt_end |= mask_t(points[i] < end) << i;
+        m.lt_max |= mask_t(points[i] < max) << i;
+    }
+    return m;
+}
+
+#ifdef PIT_SIMD_X86
+__attribute__((target("avx2")))
+inline NodeMasks compare_avx2(const int32_t *points, const int32_t &begin, const int32_t &end, const int32_t &max) {
+    const __m256i b = _mm256_set1_epi32(begin), e = _mm256_set1_epi32(end), m = _mm256_set1_epi32(max);
+    NodeMasks r{0, 0, 0};
+    for (size_t i = 0; i < BLOCK; i += 8) {
+        const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(points + i));
+        r.lt_begin |= mask_t(uint8_t(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(b, p))))) << i;
+        r.lt_end |= mask_t(uint8_t(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(e, p))))) << i;
+        r.lt_max |= mask_t(uint8_t(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(m, p))))) << i;
+    }
+    return r;
+}
+
+__attribute__((target("avx512f")))
+inline NodeMasks compare_avx512(const int32_t *points, const int32_t &begin, const int32_t &end, const int32_t &max) {
+    const __m512i b = _mm512_set1_epi32(begin), e = _mm512_set1_epi32(end), m = _mm512_set1_epi32(max);
+    NodeMasks r{0, 0, 0};
+    for (size_t i = 0; i < BLOCK; i += 16) {
+        const __m512i p = _mm512_loadu_si512(points + i);
+        r.lt_begin |= mask_t(_mm512_cmplt_epi32_mask(p, b)) << i;
+        r.lt_end |= mask_t(_mm512_cmplt_epi32_mask(p, e)) << i;
+        r.lt_max |= mask_t(_mm512_cmplt_epi32_mask(p, m)) << i;
+    }
+    return r;
+}
+#endif
+
+template <typename T>
+using compare_t = NodeMasks (*)(const T*, const T&, const T&, const T&);
+
+// The widest kernel the CPU supports, picked at runtime. Only 32 bit integers have vector kernels.
+template <typename T>
+compare_t<T> select_compare() {
+#ifdef PIT_SIMD_X86
+    if constexpr (std::is_same<T, int32_t>::value) {
+        if (__builtin_cpu_supports("avx512f")) return compare_avx512;
+        if (__builtin_cpu_supports("avx2")) return compare_avx2;
+    }
+#endif
+    return compare_scalar<T>;
+}
+
+template <typename T>
+compare_t<T> compare() {
+    static const compare_t<T> selected = select_compare<T>();
+    return selected;
+}
+
+} // namespace simd
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "it.hpp"
+#include "simd.hpp"
+
+
+// Array of the static tree: owned, or borrowed from memory the tree does not own (a mapped snapshot,
+// see snapshot.hpp). Copies of a borrowing array borrow the same memory.
+template <class X>
+class NodeArray {
+public:
+    NodeArray() {}
+    NodeArray(const NodeArray &other) : owned(other.owned), items(other.borrowed() ? other.items : owned.data()), count(other.count) {}
+    NodeArray(NodeArray &&other) noexcept : items(other.borrowed() ? other.items : nullptr), count(other.count) {
+        owned = std::move(other.owned);
+        if (!items) items = owned.data();
+    }
+    NodeArray& operator=(const NodeArray &other) {
+        owned = other.owned;
+        items = other.borrowed() ? other.items : owned.data();
+        count = other.count;
+        return *this;
+    }
+    NodeArray& operator=(NodeArray &&other) noexcept {
+        const X *borrowed_items = other.borrowed() ? other.items : nullptr;
+        owned = std::move(other.owned);
+        items = borrowed_items ? borrowed_items : owned.data();
+        count = other.count;
+        return *this;
+    }
+
+    void resize(const size_t n) {
+        owned.resize(n);
+        items = owned.data();
+        count = n;
+    }
+    void borrow(const X *memory, const size_t n) {
+        owned.clear();
+        owned.shrink_to_fit();
+        items = memory;
+        count = n;
+    }
+
+    size_t size() const { return count; }
+    const X *data() const { return items; }
+    const X &operator[](const size_t k) const { return items[k]; }
+    X &operator[](const size_t k) { return owned[k]; }
+
+private:
+    bool borrowed() const { return items && items != owned.data(); }
+
+private:
+    std::vector<X> owned;
+    const X *items = nullptr;
+    size_t count = 0;
+};
+
+
+// Read-only interval tree, built from a snapshot of an IntervalTree or ParallelIntervalTree, or from a range.
+// The nodes form an implicit, perfectly balanced tree in Eytzinger order: node k has the children 2k+1 and
+// 2k+2, so the top levels share a few cache lines and a descent needs no pointers. begin, end, max and
+// multip are separate arrays, the pruning tests of a descent only touch begin and max.
+template <typename T, size_t D = DYNAMIC_DIM>
+class StaticIntervalTree {
+public:
+    typedef T value_t;
+    typedef Point<T, D> P;
+    typedef Interval<T, D> I;
+
+    StaticIntervalTree() {}
+
+    // Snapshot of a tree, see visit_all.
+    template <class Tree>
+    explicit StaticIntervalTree(const Tree &tree) {
+        std::vector<I> intervals;
+        std::vector<size_t> multips;
+        tree.visit_all([&](const P &begin, const P &end, const size_t multip) {
+            intervals.emplace_back(begin, end);
+            multips.push_back(multip);
+        });
+        assign(intervals, multips);
+    }
+
+    // The intervals of [first, last), duplicates are collapsed.
+    template <class InputIt>
+    StaticIntervalTree(InputIt first, InputIt last) {
+        std::vector<I> intervals(first, last);
+        const std::vector<size_t> multips = sort_collapse(intervals);
+        assign(intervals, multips);
+    }
+
+    // Sorted, distinct intervals and their multiplicities.
+    StaticIntervalTree(const std::vector<I> &intervals, const std::vector<size_t> &multips) { assign(intervals, multips); }
+
+    // Serves the nodes from arrays laid out as nodes() returns them, without copying. The memory must
+    // outlive the tree and its copies.
+    void borrow(const P *begins, const P *ends, const P *maxes, const size_t *multips, const size_t n) {
+        this->begins.borrow(begins, n);
+        this->ends.borrow(ends, n);
+        this->maxes.borrow(maxes, n);
+        this->multips.borrow(multips, n);
+    }
+
+    // The node arrays in Eytzinger order, nodes() entries each.
+    const P *node_begins() const { return begins.data(); }
+    const P *node_ends() const { return ends.data(); }
+    const P *node_maxes() const { return maxes.data(); }
+    const size_t *node_multips() const { return multips.data(); }
+
+    size_t query(const P &p) const { return node_query(0, p); }
+
+    // Intervals containing p, or overlapping [begin,end). An interval stored with
+    // multiplicity k is written k times, the visitor gets f(begin, end, multip) once.
+    template <class OutputIt>
+    OutputIt query(const P &p, OutputIt out) const { return write_intervals(p, p, true, out); }
+    template <class F>
+    void visit(const P &p, F f) const { node_visit(0, p, p, true, f); }
+
+    template <class OutputIt>
+    OutputIt query_overlap(const P &begin, const P &end, OutputIt out) const { return write_intervals(begin, end, false, out); }
+    template <class F>
+    void visit_overlap(const P &begin, const P &end, F f) const { node_visit(0, begin, end, false, f); }
+    size_t count_overlap(const P &begin, const P &end) const {
+        size_t count = 0;
+        auto f = [&count](const P &, const P &, const size_t multip) { count += multip; };
+        node_visit(0, begin, end, false, f);
+        return count;
+    }
+
+    // Stabbing queries of n 1D points, counts[i] = query(points[i]). The points go down the tree in blocks
+    // of simd::BLOCK, each node is compared against a whole block with the widest kernel the CPU has.
+    // Larger batches are sorted first, so the points of a block share most of their paths.
+    void query_batch(const T *points, const size_t n, size_t *counts) const {
+        static_assert(D == 1, "query_batch takes 1D points");
+        const simd::compare_t<T> compare = simd::compare<T>();
+        std::vector<std::pair<T, size_t>> order;
+        if (n > simd::BLOCK) {
+            order.reserve(n);
+            for (size_t i = 0; i < n; ++i) order.emplace_back(points[i], i);
+            std::sort(order.begin(), order.end());
+        }
+        T block[simd::BLOCK];
+        size_t block_counts[simd::BLOCK];
+        for (size_t first = 0; first < n; first += simd::BLOCK) {
+            const size_t len = std::min(simd::BLOCK, n - first);
+            for (size_t i = 0; i < len; ++i) block[i] = order.empty() ? points[first + i] : order[first + i].first;
+            std::fill(block + len, block + simd::BLOCK, block[0]);
+            std::fill_n(block_counts, len, 0);
+            const simd::mask_t active = len == simd::BLOCK ? ~simd::mask_t(0) : (simd::mask_t(1) << len) - 1;
+            node_query_batch(0, block, active, block_counts, compare);
+            for (size_t i = 0; i < len; ++i) counts[order.empty() ? first + i : order[first + i].second] = block_counts[i];
+        }
+    }
+
+    // Every interval in key order, f(begin, end, multip).
+    template <class F>
+    void visit_all(F f) const { node_visit_all(0, f); }
+
+    // Number of distinct intervals
+    size_t nodes() const { return begins.size(); }
+
+private:
+    // intervals must be sorted and distinct.
+    void assign(const std::vector<I> &intervals, const std::vector<size_t> &multips) {
+        const size_t n = intervals.size();
+        begins.resize(n);
+        ends.resize(n);
+        maxes.resize(n);
+        this->multips.resize(n);
+        node_fill(intervals, multips, 0, 0);
+        for (size_t k = n; k-- > 0;) {
+            maxes[k] = ends[k];
+            if (2 * k + 1 < n) extend_max(maxes[k], maxes[2 * k + 1]);
+            if (2 * k + 2 < n) extend_max(maxes[k], maxes[2 * k + 2]);
+        }
+    }
+
+    // In-order walk of the implicit tree, handing out the sorted intervals from i on. Returns the next i.
+    size_t node_fill(const std::vector<I> &intervals, const std::vector<size_t> &multips, size_t i, const size_t k) {
+        if (k < begins.size()) {
+            i = node_fill(intervals, multips, i, 2 * k + 1);
+            begins[k] = intervals[i].begin;
+            ends[k] = intervals[i].end;
+            this->multips[k] = multips[i];
+            i = node_fill(intervals, multips, i + 1, 2 * k + 2);
+        }
+        return i;
+    }
+
+    // The 16 descendants four levels below k are contiguous, fetching them while this level
+    // is compared hides most of the misses further down.
+    void prefetch(const size_t k) const {
+        const size_t first = 16 * k + 15;
+        if (first < begins.size()) {
+            __builtin_prefetch(&begins[first]);
+            __builtin_prefetch(&maxes[first]);
+        }
+    }
+
+    size_t node_query(const size_t k, const P &p) const {
+        if (k >= begins.size()) {
+            return 0;
+        }
+        prefetch(k);
+        if (!all_less(p, maxes[k])) {
+            return 0;
+        } else if (p[0] < begins[k][0]) {
+            return node_query(2 * k + 1, p);
+        } else {
+            size_t subquery = node_query(2 * k + 1, p) + node_query(2 * k + 2, p);
+            if (box_overlaps(begins[k], ends[k], p, p, true)) return subquery + multips[k];
+            else return subquery;
+        }
+    }
+
+    static constexpr int BATCH_SCALAR_MAX = 4;
+
+    // node_query for the points of a block set in active.
+    void node_query_batch(const size_t k, const T *block, simd::mask_t active, size_t *counts, const simd::compare_t<T> compare) const {
+        if (k >= begins.size()) {
+            return;
+        }
+        prefetch(k);
+        const simd::NodeMasks m = compare(block, begins[k][0], ends[k][0], maxes[k][0]);
+        active &= m.lt_max;
+        if (!active) {
+            return;
+        }
+        // Once the block has split up, a whole block compare per node costs more than single descents.
+        if (__builtin_popcountll(active) <= BATCH_SCALAR_MAX) {
+            for (; active; active &= active - 1) {
+                const size_t i = __builtin_ctzll(active);
+                counts[i] += node_query(k, P(block[i]));
+            }
+            return;
+        }
+        node_query_batch(2 * k + 1, block, active, counts, compare);
+        const simd::mask_t right = active & ~m.lt_begin;
+        if (right) {
+            for (simd::mask_t hits = right & m.lt_end; hits; hits &= hits - 1) {
+                counts[__builtin_ctzll(hits)] += multips[k];
+            }
+            node_query_batch(2 * k + 2, block, right, counts, compare);
+        }
+    }
+
+    template <class OutputIt>
+    OutputIt write_intervals(const P &a, const P &b, const bool closed, OutputIt out) const {
+        auto f = [&out](const P &begin, const P &end, const size_t multip) {
+            for (size_t i = 0; i < multip; ++i) *out++ = I(begin, end);
+        };
+        node_visit(0, a, b, closed, f);
+        return out;
+    }
+
+    // Visits the intervals overlapping [a,b), or [a,b] when closed, with the pruning of IntervalTree::node_visit.
+    template <class F>
+    void node_visit(const size_t k, const P &a, const P &b, const bool closed, F &f) const {
+        if (k >= begins.size() || !all_less(a, maxes[k])) {
+            return;
+        }
+        prefetch(k);
+        node_visit(2 * k + 1, a, b, closed, f);
+        if (closed ? !(b[0] < begins[k][0]) : begins[k][0] < b[0]) {
+            if (box_overlaps(begins[k], ends[k], a, b, closed)) f(begins[k], ends[k], multips[k]);
+            node_visit(2 * k + 2, a, b, closed, f);
+        }
+    }
+
+    template <class F>
+    void node_visit_all(const size_t k, F &f) const {
+        if (k < begins.size()) {
+            node_visit_all(2 * k + 1, f);
+            f(begins[k], ends[k], multips[k]);
+            node_visit_all(2 * k + 2, f);
+        }
+    }
+
+private:
+    NodeArray<P> begins;
+    NodeArray<P> ends;
+    NodeArray<P> maxes;
+    NodeArray<size_t> multips;
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "it.hpp"
+#include "sit.hpp"
+#include "mapped.hpp"
+
+
+// Snapshot files of the trees, written by save_snapshot and opened by MappedIntervalTree::open_mapped
+// without reinserting a single interval.
+//
+// A 64 byte header, then arrays that each start at a multiple of 64 bytes:
+//   sorted section: begins, ends (count * dim values each) and multiplicities (count uint64), in key order
+//   node section, optional: begins, ends, maxes and multiplicities of the StaticIntervalTree built from
+//   the sorted intervals, in its Eytzinger order
+// Sections are found by their offsets from the start of the file, so the file can be mapped anywhere.
+// Values are stored in the byte order of the writing machine.
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint32_t value_size;
+    uint32_t value_kind;
+    uint64_t count;
+    uint64_t sorted;
+    uint64_t nodes;
+    uint8_t reserved[16];
+};
+static_assert(sizeof(SnapshotHeader) == 64, "snapshot header layout");
+static_assert(sizeof(size_t) == sizeof(uint64_t), "multiplicities are mapped as size_t");
+
+constexpr char SNAPSHOT_MAGIC[8] = {'P', 'I', 'T', 'S', 'N', 'A', 'P', '\0'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr size_t SNAPSHOT_ALIGN = 64;
+
+// Bytes of one array of the file: count points or count multiplicities, padded to SNAPSHOT_ALIGN.
+inline size_t snapshot_array_size(const size_t count, const size_t item) {
+    return (count * item + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+
+// Sorted, distinct intervals with their multiplicities, and with nodes the static tree over them.
+template <typename T, size_t D>
+bool write_snapshot(const std::string &path, const std::vector<Interval<T, D>> &intervals, const std::vector<size_t> &multips,
+                    const bool nodes, const size_t dim) {
+    typedef Point<T, D> P;
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file) return false;
+
+    const size_t n = intervals.size();
+    const size_t points = snapshot_array_size(n, dim * sizeof(T)), counts = snapshot_array_size(n, sizeof(uint64_t));
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.dim = static_cast<uint32_t>(dim);
+    header.value_size = sizeof(T);
+    header.value_kind = value_kind<T>();
+    header.count = n;
+    header.sorted = sizeof(SnapshotHeader);
+    header.nodes = nodes ? header.sorted + 2 * points + counts : 0;
+
+    // Every array goes through one zeroed buffer, padding included.
+    std::vector<char> buffer;
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    auto write_points = [&](auto point) {
+        buffer.assign(points, 0);
+        T *values = reinterpret_cast<T*>(buffer.data());
+        for (size_t i = 0; i < n; ++i) {
+            const P &p = point(i);
+            for (size_t d = 0; d < dim; ++d) values[i * dim + d] = d < p.size() ? p[d] : T();
+        }
+        ok = ok && (buffer.empty() || std::fwrite(buffer.data(), buffer.size(), 1, file) == 1);
+    };
+    auto write_counts = [&](const size_t *multip) {
+        buffer.assign(counts, 0);
+        if (n) std::memcpy(buffer.data(), multip, n * sizeof(size_t));
+        ok = ok && (buffer.empty() || std::fwrite(buffer.data(), buffer.size(), 1, file) == 1);
+    };
+
+    write_points([&](const size_t i) -> const P& { return intervals[i].begin; });
+    write_points([&](const size_t i) -> const P& { return intervals[i].end; });
+    write_counts(multips.data());
+    if (nodes) {
+        const StaticIntervalTree<T, D> tree(intervals, multips);
+        write_points([&](const size_t k) -> const P& { return tree.node_begins()[k]; });
+        write_points([&](const size_t k) -> const P& { return tree.node_ends()[k]; });
+        write_points([&](const size_t k) -> const P& { return tree.node_maxes()[k]; });
+        write_counts(tree.node_multips());
+    }
+    ok = std::fclose(file) == 0 && ok;
+    return ok;
+}
+
+// Writes the intervals of tree in key order, and with nodes the prebuilt StaticIntervalTree arrays, to a
+// snapshot file. Returns false if the file can't be written.
+// Every tree with visit_all in key order: IntervalTree, ParallelIntervalTree, StaticIntervalTree, ...
+template <class Tree>
+bool save_snapshot(const Tree &tree, const std::string &path, const bool nodes = true) {
+    typedef typename Tree::value_t T;
+    typedef typename Tree::P P;
+    constexpr size_t D = PointTraits<P>::dim;
+    std::vector<Interval<T, D>> intervals;
+    std::vector<size_t> multips;
+    tree.visit_all([&](const P &begin, const P &end, const size_t multip) {
+        intervals.emplace_back(begin, end);
+        multips.push_back(multip);
+    });
+    const size_t dim = D != DYNAMIC_DIM ? D : (intervals.empty() ? 1 : intervals[0].begin.size());
+    return write_snapshot<T, D>(path, intervals, multips, nodes, dim);
+}
+
+
+// Serves the reads of a snapshot straight from the mapped file, and turns into a mutable Tree on the
+// first write. Until then no interval is copied: the file is mapped and its header checked, so opening
+// takes the same time for any number of intervals (with a fixed dimension and the node section saved,
+// otherwise the static tree is built from the sorted section first).
+// Reads racing with the conversion finish on the mapping, which stays until the tree is destroyed.
+template <class Tree>
+class MappedIntervalTree {
+public:
+    typedef typename Tree::value_t value_t;
+    typedef typename Tree::P P;
+    typedef typename Tree::I I;
+    static constexpr size_t D = PointTraits<P>::dim;
+    typedef StaticIntervalTree<value_t, D> Static;
+
+    MappedIntervalTree() {}
+    MappedIntervalTree(const MappedIntervalTree&) = delete;
+    MappedIntervalTree& operator=(const MappedIntervalTree&) = delete;
+    ~MappedIntervalTree() { delete tree.load(std::memory_order_relaxed); }
+
+    // Returns false if the file is missing, truncated, or was saved with another value type or dimension.
+    bool open_mapped(const std::string &path) {
+        delete tree.exchange(nullptr, std::memory_order_relaxed);
+        view = Static();
+        if (!file.open(path)) return false;
+        header = reinterpret_cast<const SnapshotHeader*>(file.data());
+        if (!valid()) {
+            file.close();
+            header = nullptr;
+            return false;
+        }
+        dim = header->dim;
+        if constexpr (D != DYNAMIC_DIM) {
+            static_assert(sizeof(P) == D * sizeof(value_t), "fixed dimension points are mapped in place");
+            if (header->nodes) {
+                const size_t points = snapshot_array_size(header->count, dim * sizeof(value_t));
+                const char *nodes = file.data() + header->nodes;
+                view.borrow(reinterpret_cast<const P*>(nodes), reinterpret_cast<const P*>(nodes + points),
+                            reinterpret_cast<const P*>(nodes + 2 * points), reinterpret_cast<const size_t*>(nodes + 3 * points),
+                            header->count);
+                file.advise(MADV_RANDOM);
+                return true;
+            }
+        }
+        // Vector backed points, or no node section: the static tree is built from the sorted intervals.
+        std::vector<I> intervals;
+        std::vector<size_t> multips;
+        load_sorted(intervals, multips);
+        view = Static(intervals, multips);
+        return true;
+    }
+
+    // Still served from the snapshot, no write yet.
+    bool mapped() const { return !tree.load(std::memory_order_acquire); }
+
+    size_t query(const P &p) const {
+        if (const Tree *t = tree.load(std::memory_order_acquire)) return t->query(p);
+        return view.query(p);
+    }
+    template <class OutputIt>
+    OutputIt query(const P &p, OutputIt out) const {
+        if (const Tree *t = tree.load(std::memory_order_acquire)) return t->query(p, out);
+        return view.query(p, out);
+    }
+    template <class F>
+    void visit(const P &p, F f) const {
+        if (const Tree *t = tree.load(std::memory_order_acquire)) t->visit(p, f);
+        else view.visit(p, f);
+    }
+
+    template <class OutputIt>
+    OutputIt query_overlap(const P &begin, const P &end, OutputIt out) const {
+        if (const Tree *t = tree.load(std::memory_order_acquire)) return t->query_overlap(begin, end, out);
+        return view.query_overlap(begin, end, out);
+    }
+    template <class F>
+    void visit_overlap(const P &begin, const P &end, F f) const {
+        if (const Tree *t = tree.load(std::memory_order_acquire)) t->visit_overlap(begin, end, f);
+        else view.visit_overlap(begin, end, f);
+    }
+    size_t count_overlap(const P &begin, const P &end) const {
+        if (const Tree *t = tree.load(std::memory_order_acquire)) return t->count_overlap(begin, end);
+        return view.count_overlap(begin, end);
+    }
+
+    template <class F>
+    void visit_all(F f) const {
+        if (const Tree *t = tree.load(std::memory_order_acquire)) t->visit_all(f);
+        else view.visit_all(f);
+    }
+
+    void insert(const I &interval) { writable().insert(interval); }
+    void insert(const P &begin, const P &end) { writable().insert(begin, end); }
+    void remove(const I &interval) { writable().remove(interval); }
+    void remove(const P &begin, const P &end) { writable().remove(begin, end); }
+
+    // The mutable tree, built from the sorted section on the first call.
+    Tree &writable() {
+        if (Tree *t = tree.load(std::memory_order_acquire)) return *t;
+        std::lock_guard<std::mutex> guard(converting);
+        if (Tree *t = tree.load(std::memory_order_relaxed)) return *t;
+        Tree *t = new Tree(dim);
+        std::vector<I> intervals;
+        std::vector<size_t> multips;
+        load_sorted(intervals, multips);
+        t->build_sorted(intervals, multips);
+        tree.store(t, std::memory_order_release);
+        return *t;
+    }
+
+    bool save(const std::string &path, const bool nodes = true) const {
+        if (const Tree *t = tree.load(std::memory_order_acquire)) return save_snapshot(*t, path, nodes);
+        return save_snapshot(view, path, nodes);
+    }
+
+private:
+    // Header fields, and every section inside the file.
+    bool valid() const {
+        if (file.size() < sizeof(SnapshotHeader) || std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+            || header->version != SNAPSHOT_VERSION || header->value_size != sizeof(value_t) || header->value_kind != value_kind<value_t>()
+            || header->dim == 0 || (D != DYNAMIC_DIM && header->dim != D)) {
+            return false;
+        }
+        // Bounded by the file size first, so the section sizes below can't overflow.
+        if (header->dim > file.size() || header->count > file.size() / (header->dim * sizeof(value_t))) return false;
+        const size_t points = snapshot_array_size(header->count, header->dim * sizeof(value_t));
+        const size_t counts = snapshot_array_size(header->count, sizeof(uint64_t));
+        const bool sorted_in = header->sorted % SNAPSHOT_ALIGN == 0 && header->sorted <= file.size()
+                               && 2 * points + counts <= file.size() - header->sorted;
+        const bool nodes_in = !header->nodes || (header->nodes % SNAPSHOT_ALIGN == 0 && header->nodes <= file.size()
+                                                 && 3 * points + counts <= file.size() - header->nodes);
+        return sorted_in && nodes_in;
+    }
+
+    void load_sorted(std::vector<I> &intervals, std::vector<size_t> &multips) const {
+        const size_t n = header->count;
+        const size_t points = snapshot_array_size(n, dim * sizeof(value_t));
+        const char *sorted = file.data() + header->sorted;
+        const value_t *begins = reinterpret_cast<const value_t*>(sorted);
+        const value_t *ends = reinterpret_cast<const value_t*>(sorted + points);
+        const size_t *counts = reinterpret_cast<const size_t*>(sorted + 2 * points);
+        intervals.reserve(n);
+        for (size_t i = 0; i < n; ++i) intervals.emplace_back(load_point(begins + i * dim), load_point(ends + i * dim));
+        multips.assign(counts, counts + n);
+    }
+
+    P load_point(const value_t *values) const {
+        P p;
+        if constexpr (D == DYNAMIC_DIM) {
+            p.resize(dim);
+            p.dim = dim;
+        }
+        std::memcpy(p.data(), values, dim * sizeof(value_t));
+        return p;
+    }
+
+private:
+    MappedFile file;
+    const SnapshotHeader *header = nullptr;
+    size_t dim = 1;
+    Static view;
+    std::atomic<Tree*> tree{nullptr};
+    std::mutex converting;
+};
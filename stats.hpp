@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include "alloc.hpp"
+
+
+// Opt-in instrumentation of the trees, compiled in with -DPIT_STATS. Without it the trees share one static
+// empty TreeStats and every hook is an empty inline function, they carry neither code nor data for it.
+// Counters are striped per thread like the node count of ParallelIntervalTree, and summed on demand.
+
+enum StatsCounter {
+    STAT_QUERIES,
+    STAT_VISITED,
+    STAT_LOCKS,
+    STAT_LOCK_WAIT_NS,
+    STAT_ROTATIONS_LL,
+    STAT_ROTATIONS_RR,
+    STAT_ROTATIONS_LR,
+    STAT_ROTATIONS_RL,
+    STAT_BUILDS,
+    STAT_BUILD_NS,
+    STAT_COUNTERS
+};
+
+inline constexpr const char *stats_names[STAT_COUNTERS] = {
+    "queries", "visited", "locks", "lock_wait_ns",
+    "rotations_ll", "rotations_rr", "rotations_lr", "rotations_rl",
+    "builds", "build_ns"
+};
+
+// Counters summed over all threads, and the shape of the tree when it was taken.
+struct TreeStatsSnapshot {
+    size_t counters[STAT_COUNTERS] = {};
+    size_t height = 0;
+    size_t nodes = 0;
+    // Missing children, nullptr links
+    size_t null_nodes = 0;
+
+    size_t operator[](const StatsCounter c) const { return counters[c]; }
+    double visited_per_query() const { return counters[STAT_QUERIES] ? static_cast<double>(counters[STAT_VISITED]) / counters[STAT_QUERIES] : 0; }
+
+    std::string text() const {
+        std::ostringstream out;
+        for (int c = 0; c < STAT_COUNTERS; ++c) out << stats_names[c] << " " << counters[c] << "\n";
+        out << "height " << height << "\n" << "nodes " << nodes << "\n" << "null_nodes " << null_nodes << "\n";
+        return out.str();
+    }
+    std::string json() const {
+        std::ostringstream out;
+        out << "{";
+        for (int c = 0; c < STAT_COUNTERS; ++c) out << "\"" << stats_names[c] << "\":" << counters[c] << ",";
+        out << "\"height\":" << height << ",\"nodes\":" << nodes << ",\"null_nodes\":" << null_nodes << "}";
+        return out.str();
+    }
+};
+
+#ifdef PIT_STATS
+
+class TreeStats {
+public:
+    void add(const StatsCounter c, const size_t n = 1) const {
+        stripes[thread_index() % STRIPES].counts[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void collect(TreeStatsSnapshot &snapshot) const {
+        for (int c = 0; c < STAT_COUNTERS; ++c) {
+            size_t sum = 0;
+            for (const Stripe &stripe : stripes) sum += stripe.counts[c].load(std::memory_order_relaxed);
+            snapshot.counters[c] = sum;
+        }
+    }
+
+    void reset() {
+        for (Stripe &stripe : stripes) {
+            for (std::atomic<size_t> &count : stripe.counts) count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Locks know nothing of their tree, they count to the tree whose operation the thread runs.
+    static const TreeStats *&current() {
+        thread_local const TreeStats *stats = nullptr;
+        return stats;
+    }
+
+    typedef std::chrono::steady_clock clock;
+
+    // Elapsed time of a scope, added to counter c.
+    class Timer {
+    public:
+        Timer(const TreeStats &stats, const StatsCounter c) : stats(stats), c(c), start(clock::now()) {}
+        ~Timer() { stats.add(c, std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count()); }
+    private:
+        const TreeStats &stats;
+        const StatsCounter c;
+        const clock::time_point start;
+    };
+
+private:
+    static constexpr size_t STRIPES = 16;
+
+    struct alignas(64) Stripe {
+        std::atomic<size_t> counts[STAT_COUNTERS] = {};
+    };
+
+private:
+    mutable Stripe stripes[STRIPES];
+};
+
+// Makes stats the target of the locks taken by this thread until the end of the scope.
+class StatsScope {
+public:
+    explicit StatsScope(const TreeStats &stats) : previous(TreeStats::current()) { TreeStats::current() = &stats; }
+    ~StatsScope() { TreeStats::current() = previous; }
+private:
+    const TreeStats *previous;
+};
+
+// Takes a lock with lock(), if try_lock() fails the wait is timed.
+template <class TryLock, class Lock>
+inline void stats_lock(TryLock try_lock, Lock lock) {
+    const TreeStats *stats = TreeStats::current();
+    if (try_lock()) {
+        if (stats) stats->add(STAT_LOCKS);
+        return;
+    }
+    const TreeStats::clock::time_point start = TreeStats::clock::now();
+    lock();
+    if (stats) {
+        stats->add(STAT_LOCKS);
+        stats->add(STAT_LOCK_WAIT_NS, std::chrono::duration_cast<std::chrono::nanoseconds>(TreeStats::clock::now() - start).count());
+    }
+}
+
+#else
+
+class TreeStats {
+public:
+    void add(const StatsCounter, const size_t = 1) const {}
+    void collect(TreeStatsSnapshot &) const {}
+    void reset() const {}
+
+    class Timer {
+    public:
+        Timer(const TreeStats &, const StatsCounter) {}
+    };
+};
+
+class StatsScope {
+public:
+    explicit StatsScope(const TreeStats &) {}
+};
+
+template <class TryLock, class Lock>
+inline void stats_lock(TryLock, Lock lock) { lock(); }
+
+#endif
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "it.hpp"
+#include "harness.hpp"
+#include "mapped.hpp"
+
+
+// Binary traces of insert, remove and query calls: recorded from a running program (TraceWriter,
+// RecordingTree), replayed against any tree from a memory mapped file (MappedTrace).
+//
+// A trace is a 64 byte header followed by fixed-width records, so record i is found by its index and
+// read in place, nothing is decoded but the coordinates. A record holds the begin and the end of the
+// call (a query repeats its point), then the recording thread and the method, unpadded:
+//
+//   plain:        begin[dim] (T) | end[dim] (T)                        | thread (uint16) | method (uint8)
+//   TRACE_DELTA:  begin[dim] (T) | end - begin [dim] (int, delta_size) | thread (uint16) | method (uint8)
+//
+// TRACE_DELTA is for integral T: the end is stored as a signed delta of 1, 2 or 4 bytes, narrower
+// than T, so a trace of short intervals gets smaller. Values are stored in the byte order of the
+// recording machine.
+
+enum TraceFlags : uint32_t {
+    TRACE_DELTA = 1
+};
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t dim;
+    uint32_t value_size;
+    uint32_t value_kind;
+    uint32_t threads;
+    uint64_t count;
+    uint64_t record_size;
+    uint32_t delta_size;
+    uint8_t reserved[12];
+};
+static_assert(sizeof(TraceHeader) == 64, "trace header layout");
+
+constexpr char TRACE_MAGIC[8] = {'P', 'I', 'T', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t TRACE_VERSION = 2;
+
+// Whether ends of T can be stored as deltas of delta_size bytes. 0 stores them in full.
+template <typename T>
+constexpr bool trace_delta_size_ok(const size_t delta_size) {
+    return delta_size == 0 || (std::is_integral<T>::value && delta_size < sizeof(T)
+                               && (delta_size == 1 || delta_size == 2 || delta_size == 4));
+}
+
+// dim begin values, dim end values or deltas, then the thread (uint16) and the method (uint8).
+template <typename T>
+constexpr size_t trace_record_size(const size_t dim, const size_t delta_size = 0) {
+    return dim * (sizeof(T) + (delta_size ? delta_size : sizeof(T))) + 3;
+}
+
+
+// Appends records to a trace file. Calls may come from any thread, records are buffered and written in
+// the order they got the lock, so the calls of each thread stay in order.
+template <typename T, size_t D = DYNAMIC_DIM>
+class TraceWriter : public TaskMethods {
+public:
+    typedef Point<T, D> P;
+
+    TraceWriter() = default;
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+    ~TraceWriter() { close(); }
+
+    // For a fixed dimension D the dim argument is ignored. A delta_size of 1, 2 or 4 records the ends as
+    // deltas of that many bytes (TRACE_DELTA), a call whose end - begin does not fit fails the trace.
+    // Returns false if the file can't be created or T can't be stored in delta_size bytes.
+    bool open(const std::string &path, const size_t dim = 1, const size_t delta_size = 0) {
+        close();
+        if (!trace_delta_size_ok<T>(delta_size)) return false;
+        file = std::fopen(path.c_str(), "wb");
+        if (!file) return false;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        header.version = TRACE_VERSION;
+        header.flags = delta_size ? static_cast<uint32_t>(TRACE_DELTA) : 0;
+        header.dim = static_cast<uint32_t>(D == DYNAMIC_DIM ? dim : D);
+        header.value_size = sizeof(T);
+        header.value_kind = value_kind<T>();
+        header.delta_size = static_cast<uint32_t>(delta_size);
+        header.record_size = trace_record_size<T>(header.dim, delta_size);
+        return std::fwrite(&header, sizeof(header), 1, file) == 1;
+    }
+
+    void insert(const P &begin, const P &end) { record(INSERT, begin, end); }
+    void remove(const P &begin, const P &end) { record(REMOVE, begin, end); }
+    void query(const P &p) { record(QUERY, p, p); }
+
+    void record(const methods method, const P &begin, const P &end, const size_t thread = thread_index()) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (!file) return;
+        const size_t at = buffer.size();
+        buffer.resize(at + header.record_size);
+        char *data = buffer.data() + at;
+        const size_t width = header.delta_size ? header.delta_size : sizeof(T);
+        for (size_t d = 0; d < header.dim; ++d) {
+            const T b = d < begin.size() ? begin[d] : T();
+            const T e = d < end.size() ? end[d] : T();
+            std::memcpy(data + d * sizeof(T), &b, sizeof(T));
+            char *to = data + header.dim * sizeof(T) + d * width;
+            if (!header.delta_size) {
+                std::memcpy(to, &e, sizeof(T));
+            } else if (!put_delta(to, b, e)) {
+                failed = true;
+            }
+        }
+        const uint16_t t = static_cast<uint16_t>(thread);
+        std::memcpy(data + header.record_size - 3, &t, sizeof(t));
+        data[header.record_size - 1] = static_cast<char>(method);
+        if (header.threads <= t) header.threads = t + 1;
+        ++header.count;
+        if (buffer.size() >= BUFFER_BYTES) flush();
+    }
+
+    size_t size() const { return header.count; }
+
+    // Writes the buffered records and the final header. Returns false if any write failed.
+    bool close() {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (!file) return true;
+        flush();
+        bool ok = !failed && std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+        failed = false;
+        return ok;
+    }
+
+private:
+    static constexpr size_t BUFFER_BYTES = 1 << 20;
+
+    // Writes end - begin in header.delta_size bytes, false if it does not fit.
+    bool put_delta(char *to, const T begin, const T end) const {
+        if constexpr (std::is_integral<T>::value) {
+            typedef std::make_unsigned_t<T> U;
+            const int64_t delta = static_cast<std::make_signed_t<T>>(static_cast<U>(static_cast<U>(end) - static_cast<U>(begin)));
+            switch (header.delta_size) {
+            case 1: return put_narrow<int8_t>(to, delta);
+            case 2: return put_narrow<int16_t>(to, delta);
+            case 4: return put_narrow<int32_t>(to, delta);
+            }
+        }
+        return false;
+    }
+
+    template <typename N>
+    static bool put_narrow(char *to, const int64_t delta) {
+        const N n = static_cast<N>(delta);
+        std::memcpy(to, &n, sizeof(n));
+        return n == delta;
+    }
+
+    // The lock must be held.
+    void flush() {
+        if (!buffer.empty() && std::fwrite(buffer.data(), buffer.size(), 1, file) != 1) failed = true;
+        buffer.clear();
+    }
+
+private:
+    std::FILE *file = nullptr;
+    TraceHeader header{};
+    std::vector<char> buffer;
+    std::mutex mutex;
+    bool failed = false;
+};
+
+
+// A tree whose insert, remove and query calls are also written to a trace.
+template <class Tree>
+class RecordingTree : public Tree {
+public:
+    typedef typename Tree::value_t value_t;
+    typedef typename Tree::P P;
+    typedef typename Tree::I I;
+    typedef TraceWriter<value_t, PointTraits<P>::dim> Writer;
+
+    using Tree::Tree;
+
+    Writer &trace() { return writer; }
+
+    void insert(const I &interval) { insert(interval.begin, interval.end); }
+    void insert(const P &begin, const P &end) {
+        writer.insert(begin, end);
+        Tree::insert(begin, end);
+    }
+
+    void remove(const I &interval) { remove(interval.begin, interval.end); }
+    void remove(const P &begin, const P &end) {
+        writer.remove(begin, end);
+        Tree::remove(begin, end);
+    }
+
+    size_t query(const P &p) const {
+        writer.query(p);
+        return Tree::query(p);
+    }
+
+private:
+    mutable Writer writer;
+};
+
+
+// A trace file mapped read-only. Records are read in place, and replayed on a WorkerPool: the calls
+// recorded by thread t run on worker t % workers, in their recorded order.
+template <typename T, size_t D = DYNAMIC_DIM>
+class MappedTrace : public TaskMethods {
+public:
+    typedef Point<T, D> P;
+
+    MappedTrace() = default;
+    MappedTrace(const MappedTrace&) = delete;
+    MappedTrace& operator=(const MappedTrace&) = delete;
+    ~MappedTrace() { close(); }
+
+    // Returns false if the file is missing, truncated, or was recorded with another value type or dimension.
+    bool open(const std::string &path) {
+        close();
+        if (!file.open(path)) return false;
+        header = reinterpret_cast<const TraceHeader*>(file.data());
+        if (file.size() < sizeof(TraceHeader) || std::memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+            || header->version != TRACE_VERSION || header->value_size != sizeof(T) || header->value_kind != value_kind<T>()
+            || (D != DYNAMIC_DIM && header->dim != D) || !trace_delta_size_ok<T>(header->delta_size) || (header->flags & TRACE_DELTA) != (header->delta_size != 0)
+            || header->record_size != trace_record_size<T>(header->dim, header->delta_size)
+            || (file.size() - sizeof(TraceHeader)) / header->record_size < header->count) {
+            close();
+            return false;
+        }
+        file.advise(MADV_SEQUENTIAL);
+        return true;
+    }
+
+    void close() {
+        file.close();
+        header = nullptr;
+    }
+
+    size_t size() const { return header ? header->count : 0; }
+    size_t dim() const { return header ? header->dim : 0; }
+    // Highest recorded thread + 1.
+    size_t threads() const { return header ? header->threads : 0; }
+
+    methods method(const size_t i) const { return static_cast<methods>(record(i)[header->record_size - 1]); }
+    size_t thread(const size_t i) const {
+        uint16_t t;
+        std::memcpy(&t, record(i) + header->record_size - 3, sizeof(t));
+        return t;
+    }
+    P begin(const size_t i) const { return point(i, 0); }
+    P end(const size_t i) const {
+        if (!header->delta_size) return point(i, header->dim * sizeof(T));
+        P p = begin(i);
+        if constexpr (std::is_integral<T>::value) {
+            typedef std::make_unsigned_t<T> U;
+            const char *from = record(i) + header->dim * sizeof(T);
+            for (size_t d = 0; d < header->dim; ++d, from += header->delta_size) {
+                const int64_t delta = header->delta_size == 1 ? get_narrow<int8_t>(from)
+                                    : header->delta_size == 2 ? get_narrow<int16_t>(from) : get_narrow<int32_t>(from);
+                p[d] = static_cast<T>(static_cast<U>(p[d]) + static_cast<U>(delta));
+            }
+        }
+        return p;
+    }
+
+    // Calls the tree as record i was called.
+    template <class Tree>
+    void apply(Tree &tree, const size_t i) const {
+        switch (method(i)) {
+        case QUERY:
+            tree.query(begin(i));
+            break;
+        case INSERT:
+            tree.insert(begin(i), end(i));
+            break;
+        case REMOVE:
+            tree.remove(begin(i), end(i));
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Runs f(worker, i) for every record i on the worker of its thread, returns the seconds from the
+    // common start to the last finish. The records are split between the workers before the start.
+    template <class F>
+    double dispatch(WorkerPool &pool, F f) const {
+        std::vector<std::vector<size_t>> mine(pool.size());
+        for (size_t i = 0; i < size(); ++i) mine[thread(i) % pool.size()].push_back(i);
+        return pool.run([&](const size_t worker) {
+            for (const size_t i : mine[worker]) f(worker, i);
+        });
+    }
+
+    template <class Tree>
+    double replay(Tree &tree, WorkerPool &pool) const {
+        return dispatch(pool, [&](size_t, const size_t i) { apply(tree, i); });
+    }
+
+private:
+    const char *record(const size_t i) const { return file.data() + sizeof(TraceHeader) + i * header->record_size; }
+
+    template <typename N>
+    static int64_t get_narrow(const char *from) {
+        N n;
+        std::memcpy(&n, from, sizeof(n));
+        return n;
+    }
+
+    // The dim values at byte offset of record i.
+    P point(const size_t i, const size_t offset) const {
+        P p;
+        if constexpr (D == DYNAMIC_DIM) {
+            p.resize(header->dim);
+            p.dim = header->dim;
+        }
+        std::memcpy(p.data(), record(i) + offset, header->dim * sizeof(T));
+        return p;
+    }
+
+private:
+    MappedFile file;
+    const TraceHeader *header = nullptr;
+};